@@ -38,15 +38,39 @@
 #define ASSISTED_TELEOP_ASSISTED_TELEOP_H_
 #include <ros/ros.h>
 #include <geometry_msgs/Twist.h>
+#include <std_msgs/Float64.h>
+#include <std_msgs/UInt32.h>
 #include <costmap_2d/costmap_2d_ros.h>
 #include <base_local_planner/trajectory_planner_ros.h>
+#include <base_local_planner/costmap_model.h>
+#include <base_local_planner/odometry_helper_ros.h>
+#include <nav_msgs/Odometry.h>
 #include <boost/thread.hpp>
 #include <Eigen/Core>
+#include <atomic>
+#include <pose_base_controller/seqlock.h>
+#include <vector>
 #include <tf2_ros/buffer.h>
 #include <tf2_ros/transform_listener.h>
 
 
 namespace assisted_teleop {
+  /**
+   * @brief Single slot that holds the latest teleop command, written by one thread and read by others without locking
+   */
+  class CommandMailbox {
+    public:
+      void write(double x, double y, double th, double received);
+
+      /**
+       * @return The sequence number of the command that was read, it changes with every write
+       */
+      unsigned int read(Eigen::Vector3f& vel, double& received) const;
+
+    private:
+      pose_base_controller::SeqLock<double, 4> command_; /**< x, y, th and the wall time in seconds it was received */
+  };
+
   class AssistedTeleop {
     public:
       AssistedTeleop();
@@ -55,19 +79,116 @@ namespace assisted_teleop {
       void velCB(const geometry_msgs::TwistConstPtr& vel);
       void controlLoop();
 
+      /**
+       * @brief Control loop of the event driven mode, runs whenever a command comes in or the last one gets stale
+       */
+      void eventLoop();
+
+      /**
+       * @brief Find a legal command close to desired_vel and publish it
+       */
+      void computeCommand(const Eigen::Vector3f& desired_vel);
+
+      /**
+       * @brief Check the samples to_check_[begin, end) in parallel on the sampling threads and the calling thread
+       */
+      void checkSamples(unsigned int begin, unsigned int end);
+
+      /**
+       * @brief Check samples until there are none left in the current round, called by every thread taking part
+       */
+      void checkNextSamples(unsigned int thread);
+
+      /**
+       * @brief Create one collision checker per sampling thread and read the parameters of the planner they mirror
+       */
+      void createCheckers();
+
+      /**
+       * @brief Check a sample with the collision checker of the given thread
+       */
+      bool checkSample(unsigned int thread, const Eigen::Vector3f& vel);
+
+      /**
+       * @brief Roll a sample out the way TrajectoryPlanner::checkTrajectory does and check it against the costmap
+       *
+       * The reachability of the cells along the rollout is taken from the map grids that planner_ computed
+       * for the current cycle, which no thread writes while samples are checked.
+       */
+      bool rolloutLegal(base_local_planner::CostmapModel& world_model, const Eigen::Vector3f& vel);
+
+      /**
+       * @brief Check the samples by increasing distance to the desired velocity until one is legal
+       */
+      void checkNearestFirst();
+
+      /**
+       * @brief Check every coarse_stride_-th sample, then the full grid around the best legal one
+       */
+      void checkCoarseToFine();
+
+      /**
+       * @brief Publish how many trajectories the current control cycle checked
+       */
+      void publishChecks();
+
+      /**
+       * @brief Helper thread that joins in checkSamples()
+       */
+      void samplingThread(unsigned int thread);
+
       tf2_ros::Buffer tf_;
       tf2_ros::TransformListener tfl_;
       costmap_2d::Costmap2DROS costmap_ros_;
       double controller_frequency_;
       base_local_planner::TrajectoryPlannerROS planner_;
-      boost::mutex mutex_;
-      geometry_msgs::Twist cmd_vel_;
+      CommandMailbox cmd_mailbox_;
       boost::thread* planning_thread_;
       double theta_range_;
       int num_th_samples_, num_x_samples_;
       ros::Publisher pub_;
       ros::Subscriber sub_;
       double collision_trans_speed_, collision_rot_speed_;
+
+      bool event_driven_;
+      double staleness_timeout_; /**< longest time the event driven mode goes without computing a command */
+      boost::mutex event_mutex_;
+      boost::condition_variable event_cond_; /**< signalled by velCB in the event driven mode */
+      ros::Publisher latency_pub_;
+
+      int num_sampling_threads_;
+      /**
+       * footprint checkers of the sampling threads, empty with a single thread; a CostmapModel keeps
+       * no state between calls, so one per thread costs next to nothing
+       */
+      std::vector<boost::shared_ptr<base_local_planner::CostmapModel> > checkers_;
+      std::vector<geometry_msgs::Point> footprint_;
+      double inscribed_radius_, circumscribed_radius_;
+      double acc_lim_x_, acc_lim_y_, acc_lim_theta_; /**< the rollout parameters of planner_, read from ~planner */
+      double sim_time_, sim_granularity_, angular_sim_granularity_;
+      bool heading_scoring_, simple_attractor_;
+      double heading_scoring_timestep_;
+      base_local_planner::OdometryHelperRos odom_helper_;
+      bool cycle_pose_valid_;
+      geometry_msgs::PoseStamped cycle_pose_; /**< robot pose the samples of the current cycle start from */
+      nav_msgs::Odometry cycle_odom_; /**< robot velocity the samples of the current cycle start from */
+      boost::thread_group sampling_threads_; /**< all but one of the threads checking samples, the control loop is the last one */
+      boost::mutex sampling_mutex_;
+      boost::condition_variable sampling_cond_, sampling_done_cond_;
+      unsigned int sampling_round_; /**< incremented for every checkSamples() call */
+      unsigned int sampling_busy_; /**< helper threads that have not finished the current round yet */
+      bool shutdown_;
+      std::string sampling_mode_; /**< grid, nearest_first or coarse_to_fine */
+      int coarse_stride_;
+      ros::Publisher checks_pub_;
+      unsigned int num_checks_; /**< trajectories checked in the current control cycle */
+
+      std::vector<Eigen::Vector3f> samples_; /**< velocity grid of the current control cycle, num_th_samples_ per row */
+      std::vector<double> sample_dist_; /**< squared distance of each of samples_ to the desired velocity */
+      std::vector<char> sample_legal_; /**< result for each of samples_, written by whichever thread checked it, false if unchecked */
+      std::vector<unsigned int> to_check_; /**< indices into samples_, in the order they are checked */
+      std::atomic<unsigned int> next_sample_; /**< next position in to_check_ to hand out */
+      unsigned int samples_end_; /**< end of the current round in to_check_ */
   };
 };
 #endif
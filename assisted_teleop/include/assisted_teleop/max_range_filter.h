@@ -54,17 +54,43 @@ namespace assisted_teleop
 
       bool update(const sensor_msgs::LaserScan& input_scan, sensor_msgs::LaserScan& filtered_scan)
       {
-        filtered_scan = input_scan;
-
-        for(unsigned int i = 0; i < filtered_scan.ranges.size(); ++i)
+        //copy field by field instead of assigning the whole message, so that the vectors of a
+        //filtered_scan that is used again keep their capacity, and the ranges are written once
+        if(&input_scan != &filtered_scan)
         {
-          //set to just below max range if its greater than max range
-          if(filtered_scan.ranges[i] >= filtered_scan.range_max || filtered_scan.ranges[i] <= filtered_scan.range_min)
-            filtered_scan.ranges[i] = filtered_scan.range_max - 1e-4;
+          filtered_scan.header = input_scan.header;
+          filtered_scan.angle_min = input_scan.angle_min;
+          filtered_scan.angle_max = input_scan.angle_max;
+          filtered_scan.angle_increment = input_scan.angle_increment;
+          filtered_scan.time_increment = input_scan.time_increment;
+          filtered_scan.scan_time = input_scan.scan_time;
+          filtered_scan.range_min = input_scan.range_min;
+          filtered_scan.range_max = input_scan.range_max;
+          filtered_scan.intensities.assign(input_scan.intensities.begin(), input_scan.intensities.end());
+          filtered_scan.ranges.resize(input_scan.ranges.size());
         }
 
+        clampRanges(input_scan.ranges.data(), filtered_scan.ranges.data(), input_scan.ranges.size(),
+                    input_scan.range_min, input_scan.range_max);
         return true;
       }
+
+      /**
+       * @brief Set ranges that are not within (range_min, range_max) to just below max range
+       *
+       * The loop has no branches, so the compiler can vectorize it. NaN fails both comparisons
+       * and is passed on unchanged, as are ranges within the limits. ranges and filtered may be
+       * the same array.
+       */
+      static void clampRanges(const float* ranges, float* filtered, size_t n, float range_min, float range_max)
+      {
+        const float replacement = range_max - 1e-4;
+        for(size_t i = 0; i < n; ++i)
+        {
+          const float range = ranges[i];
+          filtered[i] = ((range >= range_max) | (range <= range_min)) ? replacement : range;
+        }
+      }
   };
 };
 #endif
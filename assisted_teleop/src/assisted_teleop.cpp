@@ -35,9 +35,15 @@
 * Author: Eitan Marder-Eppstein
 *********************************************************************/
 #include <assisted_teleop/assisted_teleop.h>
+#include <tf2/utils.h>
+#include <costmap_2d/footprint.h>
+#include <algorithm>
+#include <cmath>
 
 namespace assisted_teleop {
-  AssistedTeleop::AssistedTeleop() : tfl_(tf_), costmap_ros_("costmap", tf_), planning_thread_(NULL){
+  AssistedTeleop::AssistedTeleop() : tfl_(tf_), costmap_ros_("costmap", tf_), planning_thread_(NULL),
+    inscribed_radius_(0.0), circumscribed_radius_(0.0), cycle_pose_valid_(false), sampling_round_(0), sampling_busy_(0), shutdown_(false),
+    num_checks_(0), samples_end_(0){
     ros::NodeHandle private_nh("~");
     private_nh.param("controller_frequency", controller_frequency_, 10.0);
     private_nh.param("num_th_samples", num_th_samples_, 20);
@@ -45,14 +51,32 @@ namespace assisted_teleop {
     private_nh.param("theta_range", theta_range_, 0.7);
     private_nh.param("translational_collision_speed", collision_trans_speed_, 0.0);
     private_nh.param("rotational_collision_speed", collision_rot_speed_, 0.0);
+    private_nh.param("sampling_threads", num_sampling_threads_, 1);
+    private_nh.param("sampling_mode", sampling_mode_, std::string("grid"));
+    private_nh.param("coarse_stride", coarse_stride_, 3);
+    private_nh.param("event_driven", event_driven_, false);
+    //by default, don't go longer without a look at the costmap than it takes the costmap to update
+    double costmap_update_frequency;
+    private_nh.param("costmap/update_frequency", costmap_update_frequency, 5.0);
+    private_nh.param("staleness_timeout", staleness_timeout_, 1.0 / std::max(costmap_update_frequency, 1e-3));
+    if(sampling_mode_ != "grid" && sampling_mode_ != "nearest_first" && sampling_mode_ != "coarse_to_fine"){
+      ROS_WARN("Unknown sampling_mode %s, checking the full grid", sampling_mode_.c_str());
+      sampling_mode_ = "grid";
+    }
+    coarse_stride_ = std::max(coarse_stride_, 1);
     planner_.initialize("planner", &tf_, &costmap_ros_);
 
+    //the control loop checks samples too, so it only needs helpers for the other threads
+    if(num_sampling_threads_ > 1)
+      createCheckers();
+    for(int i = 1; i < num_sampling_threads_; ++i)
+      sampling_threads_.create_thread(boost::bind(&AssistedTeleop::samplingThread, this, i));
+
     ros::NodeHandle n;
     pub_ = n.advertise<geometry_msgs::Twist>("cmd_vel", 1);
+    checks_pub_ = private_nh.advertise<std_msgs::UInt32>("trajectory_checks", 1);
+    latency_pub_ = private_nh.advertise<std_msgs::Float64>("command_latency", 1);
     sub_ = n.subscribe("teleop_cmd_vel", 10, &AssistedTeleop::velCB, this);
-    cmd_vel_.linear.x = 0.0;
-    cmd_vel_.linear.y = 0.0;
-    cmd_vel_.linear.z = 0.0;
 
     planning_thread_ = new boost::thread(boost::bind(&AssistedTeleop::controlLoop, this));
   }
@@ -60,104 +84,390 @@ namespace assisted_teleop {
   AssistedTeleop::~AssistedTeleop(){
     planning_thread_->join();
     delete planning_thread_;
+
+    {
+      boost::mutex::scoped_lock lock(sampling_mutex_);
+      shutdown_ = true;
+    }
+    sampling_cond_.notify_all();
+    sampling_threads_.join_all();
+  }
+
+  void AssistedTeleop::createCheckers(){
+    //the rollout parameters of the planner, under the same names and with the same defaults as
+    //TrajectoryPlannerROS reads them; they are read once here, so reconfiguring the planner does
+    //not reach the sampling threads
+    ros::NodeHandle planner_nh("~/planner");
+    std::string odom_topic;
+    planner_nh.param("acc_lim_x", acc_lim_x_, 2.5);
+    planner_nh.param("acc_lim_y", acc_lim_y_, 2.5);
+    planner_nh.param("acc_lim_theta", acc_lim_theta_, 3.2);
+    planner_nh.param("sim_time", sim_time_, 1.0);
+    planner_nh.param("sim_granularity", sim_granularity_, 0.025);
+    planner_nh.param("angular_sim_granularity", angular_sim_granularity_, sim_granularity_);
+    planner_nh.param("heading_scoring", heading_scoring_, false);
+    planner_nh.param("heading_scoring_timestep", heading_scoring_timestep_, 0.8);
+    planner_nh.param("simple_attractor", simple_attractor_, false);
+    planner_nh.param("odom_topic", odom_topic, std::string("odom"));
+    odom_helper_.setOdomTopic(odom_topic);
+
+    footprint_ = costmap_ros_.getRobotFootprint();
+    costmap_2d::calculateMinAndMaxDistances(footprint_, inscribed_radius_, circumscribed_radius_);
+    checkers_.resize(num_sampling_threads_);
+    for(unsigned int i = 0; i < checkers_.size(); ++i)
+      checkers_[i].reset(new base_local_planner::CostmapModel(*costmap_ros_.getCostmap()));
+  }
+
+  bool AssistedTeleop::checkSample(unsigned int thread, const Eigen::Vector3f& vel){
+    if(checkers_.empty())
+      return planner_.checkTrajectory(vel[0], vel[1], vel[2], false);
+    if(!cycle_pose_valid_)
+      return false;
+    return rolloutLegal(*checkers_[thread], vel);
+  }
+
+  namespace {
+    double computeNewVelocity(double vg, double vi, double a_max, double dt){
+      if((vg - vi) >= 0)
+        return std::min(vg, vi + a_max * dt);
+      return std::max(vg, vi - a_max * dt);
+    }
+  }
+
+  bool AssistedTeleop::rolloutLegal(base_local_planner::CostmapModel& world_model, const Eigen::Vector3f& vel){
+    const costmap_2d::Costmap2D& costmap = *costmap_ros_.getCostmap();
+    double x_i = cycle_pose_.pose.position.x;
+    double y_i = cycle_pose_.pose.position.y;
+    double theta_i = tf2::getYaw(cycle_pose_.pose.orientation);
+    double vx_i = cycle_odom_.twist.twist.linear.x;
+    double vy_i = cycle_odom_.twist.twist.linear.y;
+    double vtheta_i = cycle_odom_.twist.twist.angular.z;
+
+    //same step count and integration as TrajectoryPlanner::generateTrajectory
+    double vmag = hypot(vel[0], vel[1]);
+    int num_steps;
+    if(!heading_scoring_)
+      num_steps = int(std::max((vmag * sim_time_) / sim_granularity_, fabs(vel[2]) / angular_sim_granularity_) + 0.5);
+    else
+      num_steps = int(sim_time_ / sim_granularity_ + 0.5);
+    if(num_steps == 0)
+      num_steps = 1;
+    double dt = sim_time_ / num_steps;
+    double time = 0.0;
+
+    for(int i = 0; i < num_steps; ++i){
+      unsigned int cell_x, cell_y;
+      if(!costmap.worldToMap(x_i, y_i, cell_x, cell_y))
+        return false;
+      if(world_model.footprintCost(x_i, y_i, theta_i, footprint_, inscribed_radius_, circumscribed_radius_) < 0)
+        return false;
+
+      //the planner only looks at the path and goal distances where it scores them; with the robot
+      //pose as the plan, a cell the planner cannot reach is an obstacle or cut off from the robot
+      bool scored = !simple_attractor_ &&
+        (!heading_scoring_ || (time >= heading_scoring_timestep_ && time < heading_scoring_timestep_ + dt));
+      float path_cost, goal_cost, occ_cost, total_cost;
+      if(scored && !planner_.getCellCosts(cell_x, cell_y, path_cost, goal_cost, occ_cost, total_cost))
+        return false;
+
+      vx_i = computeNewVelocity(vel[0], vx_i, acc_lim_x_, dt);
+      vy_i = computeNewVelocity(vel[1], vy_i, acc_lim_y_, dt);
+      vtheta_i = computeNewVelocity(vel[2], vtheta_i, acc_lim_theta_, dt);
+      x_i += (vx_i * cos(theta_i) + vy_i * cos(M_PI_2 + theta_i)) * dt;
+      y_i += (vx_i * sin(theta_i) + vy_i * sin(M_PI_2 + theta_i)) * dt;
+      theta_i += vtheta_i * dt;
+      time += dt;
+    }
+    return true;
+  }
+
+  void AssistedTeleop::checkNextSamples(unsigned int thread){
+    unsigned int k;
+    while((k = next_sample_++) < samples_end_){
+      unsigned int i = to_check_[k];
+      sample_legal_[i] = checkSample(thread, samples_[i]);
+    }
+  }
+
+  void AssistedTeleop::checkSamples(unsigned int begin, unsigned int end){
+    num_checks_ += end - begin;
+    next_sample_ = begin;
+    samples_end_ = end;
+    {
+      boost::mutex::scoped_lock lock(sampling_mutex_);
+      sampling_busy_ = sampling_threads_.size();
+      ++sampling_round_;
+    }
+    sampling_cond_.notify_all();
+
+    checkNextSamples(0);
+
+    //wait for the helpers to finish the samples they took
+    boost::mutex::scoped_lock lock(sampling_mutex_);
+    while(sampling_busy_ > 0)
+      sampling_done_cond_.wait(lock);
+  }
+
+  void AssistedTeleop::samplingThread(unsigned int thread){
+    unsigned int round = 0;
+    boost::mutex::scoped_lock lock(sampling_mutex_);
+    while(true){
+      while(!shutdown_ && round == sampling_round_)
+        sampling_cond_.wait(lock);
+      if(shutdown_)
+        return;
+      round = sampling_round_;
+
+      lock.unlock();
+      checkNextSamples(thread);
+      lock.lock();
+
+      if(--sampling_busy_ == 0)
+        sampling_done_cond_.notify_one();
+    }
+  }
+
+  void AssistedTeleop::checkNearestFirst(){
+    //the sample we are after is the first legal one in this order; a stable sort keeps ties
+    //in grid order, so this finds the same sample as checking the whole grid
+    to_check_.resize(samples_.size());
+    for(unsigned int i = 0; i < to_check_.size(); ++i)
+      to_check_[i] = i;
+    std::stable_sort(to_check_.begin(), to_check_.end(),
+                     [this](unsigned int a, unsigned int b){ return sample_dist_[a] < sample_dist_[b]; });
+
+    //one sample per thread and round, so no thread checks far past the first legal sample
+    const unsigned int batch = sampling_threads_.size() + 1;
+    for(unsigned int begin = 0; begin < to_check_.size(); begin += batch){
+      unsigned int end = std::min<unsigned int>(begin + batch, to_check_.size());
+      checkSamples(begin, end);
+      for(unsigned int k = begin; k < end; ++k){
+        if(sample_legal_[to_check_[k]])
+          return;
+      }
+    }
+  }
+
+  void AssistedTeleop::checkCoarseToFine(){
+    std::vector<char> checked(samples_.size(), false);
+    to_check_.clear();
+    for(int i = 0; i < num_x_samples_; i += coarse_stride_){
+      for(int j = 0; j < num_th_samples_; j += coarse_stride_){
+        to_check_.push_back(i * num_th_samples_ + j);
+        checked[i * num_th_samples_ + j] = true;
+      }
+    }
+    checkSamples(0, to_check_.size());
+
+    int best = -1;
+    for(unsigned int k = 0; k < to_check_.size(); ++k){
+      if(sample_legal_[to_check_[k]] && (best < 0 || sample_dist_[to_check_[k]] < sample_dist_[best]))
+        best = to_check_[k];
+    }
+
+    //refine around the best coarse sample, up to the neighbouring coarse samples; without
+    //a legal coarse sample, there is nothing to go by and the rest of the grid is checked
+    int min_i = 0, max_i = num_x_samples_ - 1, min_j = 0, max_j = num_th_samples_ - 1;
+    if(best >= 0){
+      min_i = std::max(best / num_th_samples_ - coarse_stride_ + 1, 0);
+      max_i = std::min(best / num_th_samples_ + coarse_stride_ - 1, num_x_samples_ - 1);
+      min_j = std::max(best % num_th_samples_ - coarse_stride_ + 1, 0);
+      max_j = std::min(best % num_th_samples_ + coarse_stride_ - 1, num_th_samples_ - 1);
+    }
+    unsigned int begin = to_check_.size();
+    for(int i = min_i; i <= max_i; ++i){
+      for(int j = min_j; j <= max_j; ++j){
+        if(!checked[i * num_th_samples_ + j])
+          to_check_.push_back(i * num_th_samples_ + j);
+      }
+    }
+    checkSamples(begin, to_check_.size());
+  }
+
+  void AssistedTeleop::publishChecks(){
+    ROS_DEBUG("Checked %u trajectories", num_checks_);
+    std_msgs::UInt32 checks;
+    checks.data = num_checks_;
+    checks_pub_.publish(checks);
+  }
+
+  void CommandMailbox::write(double x, double y, double th, double received){
+    command_.write({{x, y, th, received}});
+  }
+
+  unsigned int CommandMailbox::read(Eigen::Vector3f& vel, double& received) const{
+    pose_base_controller::SeqLock<double, 4>::Values command;
+    unsigned int seq = command_.read(command);
+    vel[0] = command[0];
+    vel[1] = command[1];
+    vel[2] = command[2];
+    received = command[3];
+    return seq;
   }
 
   void AssistedTeleop::velCB(const geometry_msgs::TwistConstPtr& vel){
-    boost::mutex::scoped_lock lock(mutex_);
-    cmd_vel_ = *vel;
+    cmd_mailbox_.write(vel->linear.x, vel->linear.y, vel->angular.z, ros::WallTime::now().toSec());
+    if(event_driven_){
+      //taking the lock once makes sure the control loop is either waiting or has not read the mailbox yet
+      { boost::mutex::scoped_lock lock(event_mutex_); }
+      event_cond_.notify_one();
+    }
   }
 
   void AssistedTeleop::controlLoop(){
+    if(event_driven_){
+      eventLoop();
+      return;
+    }
+
     ros::Rate r(controller_frequency_);
     while(ros::ok()){
       Eigen::Vector3f desired_vel = Eigen::Vector3f::Zero();
+      double received;
+      cmd_mailbox_.read(desired_vel, received);
+      computeCommand(desired_vel);
+      r.sleep();
+    }
+  }
 
-      //we'll copy over odometry and velocity data for planning
-      {
-        boost::mutex::scoped_lock lock(mutex_);
-        desired_vel[0] = cmd_vel_.linear.x;
-        desired_vel[1] = cmd_vel_.linear.y;
-        desired_vel[2] = cmd_vel_.angular.z;
+  void AssistedTeleop::eventLoop(){
+    unsigned int last_seq = 0;
+    boost::mutex::scoped_lock lock(event_mutex_);
+    while(ros::ok()){
+      //the costmap has no update notification, the staleness timeout makes sure that its
+      //changes are taken into account even while the command stays the same
+      Eigen::Vector3f desired_vel = Eigen::Vector3f::Zero();
+      double received;
+      unsigned int seq = cmd_mailbox_.read(desired_vel, received);
+      if(seq == last_seq){
+        event_cond_.wait_for(lock, boost::chrono::duration<double>(staleness_timeout_));
+        seq = cmd_mailbox_.read(desired_vel, received);
       }
+      bool new_command = seq != last_seq;
+      last_seq = seq;
 
-      //first, we'll check the trajectory that the user sent in... if its legal... we'll just follow it
-      if(planner_.checkTrajectory(desired_vel[0], desired_vel[1], desired_vel[2], true)){
-        geometry_msgs::Twist cmd;
-        cmd.linear.x = desired_vel[0];
-        cmd.linear.y = desired_vel[1];
-        cmd.angular.z = desired_vel[2];
-        pub_.publish(cmd);
-        r.sleep();
-        continue;
+      lock.unlock();
+      computeCommand(desired_vel);
+      if(new_command){
+        std_msgs::Float64 latency;
+        latency.data = ros::WallTime::now().toSec() - received;
+        latency_pub_.publish(latency);
       }
+      lock.lock();
+    }
+  }
 
-      double dth = (theta_range_) / double(num_th_samples_);
-      double dx = desired_vel[0] / double(num_x_samples_);
-      double start_th = desired_vel[2] - theta_range_ / 2.0 ;
-
-      Eigen::Vector3f best = Eigen::Vector3f::Zero();
-      double best_dist = DBL_MAX;
-      bool trajectory_found = false;
-
-      //if we don't have a valid trajectory... we'll start checking others in the angular range specified
-      for(int i = 0; i < num_x_samples_; ++i){
-        Eigen::Vector3f check_vel = Eigen::Vector3f::Zero();
-        check_vel[0] = desired_vel[0] - i * dx;
-        check_vel[1] = desired_vel[1];
-        check_vel[2] = start_th;
-        for(int j = 0; j < num_th_samples_; ++j){
-          check_vel[2] = start_th + j * dth;
-          if(planner_.checkTrajectory(check_vel[0], check_vel[1], check_vel[2], false)){
-            //if we have a legal trajectory, we'll score it based on its distance to our desired velocity
-            Eigen::Vector3f diffs = (desired_vel - check_vel);
-            double sq_dist = diffs[0] * diffs[0] + diffs[1] * diffs[1] + diffs[2] * diffs[2];
-
-            //if we have a trajectory that is better than our best one so far, we'll take it
-            if(sq_dist < best_dist){
-              best = check_vel;
-              best_dist = sq_dist;
-              trajectory_found = true;
-            }
-          }
-        }
+  void AssistedTeleop::computeCommand(const Eigen::Vector3f& desired_vel){
+    //first, we'll check the trajectory that the user sent in... if its legal... we'll just follow it
+    num_checks_ = 1;
+    if(planner_.checkTrajectory(desired_vel[0], desired_vel[1], desired_vel[2], true)){
+      geometry_msgs::Twist cmd;
+      cmd.linear.x = desired_vel[0];
+      cmd.linear.y = desired_vel[1];
+      cmd.angular.z = desired_vel[2];
+      pub_.publish(cmd);
+      publishChecks();
+      return;
+    }
+
+    double dth = (theta_range_) / double(num_th_samples_);
+    double dx = desired_vel[0] / double(num_x_samples_);
+    double start_th = desired_vel[2] - theta_range_ / 2.0 ;
+
+    Eigen::Vector3f best = Eigen::Vector3f::Zero();
+    double best_dist = DBL_MAX;
+    bool trajectory_found = false;
+
+    //if we don't have a valid trajectory... we'll start checking others in the angular range specified
+    samples_.clear();
+    for(int i = 0; i < num_x_samples_; ++i){
+      Eigen::Vector3f check_vel = Eigen::Vector3f::Zero();
+      check_vel[0] = desired_vel[0] - i * dx;
+      check_vel[1] = desired_vel[1];
+      check_vel[2] = start_th;
+      for(int j = 0; j < num_th_samples_; ++j){
+        check_vel[2] = start_th + j * dth;
+        samples_.push_back(check_vel);
       }
+    }
+
+    //we'll score legal trajectories based on their distance to our desired velocity, which is
+    //known before checking any of them
+    sample_dist_.resize(samples_.size());
+    for(unsigned int i = 0; i < samples_.size(); ++i){
+      Eigen::Vector3f diffs = (desired_vel - samples_[i]);
+      sample_dist_[i] = diffs[0] * diffs[0] + diffs[1] * diffs[1] + diffs[2] * diffs[2];
+    }
+
+    //all threads start their samples from the same pose and velocity; the map grids they check
+    //reachability against were computed by the check of the desired velocity above
+    if(!checkers_.empty()){
+      cycle_pose_valid_ = costmap_ros_.getRobotPose(cycle_pose_);
+      if(!cycle_pose_valid_)
+        ROS_WARN("Failed to get the pose of the robot. No trajectories will pass as legal in this case.");
+      odom_helper_.getOdom(cycle_odom_);
+    }
 
-      //check if best is still zero, if it is... scale the original trajectory based on the collision_speed requested
-      //but we only need to do this if the user has set a non-zero collision speed
-      if(!trajectory_found && (collision_trans_speed_ > 0.0 || collision_rot_speed_ > 0.0)){
-        double trans_scaling_factor = 0.0;
-        double rot_scaling_factor = 0.0;
-        double scaling_factor = 0.0;
-
-        if(fabs(desired_vel[0]) > 0 && fabs(desired_vel[1]) > 0)
-          trans_scaling_factor = std::min(collision_trans_speed_ / fabs(desired_vel[0]), collision_trans_speed_ / fabs(desired_vel[1]));
-        else if(fabs(desired_vel[0]) > 0)
-          trans_scaling_factor = collision_trans_speed_ / (fabs(desired_vel[0]));
-        else if(fabs(desired_vel[1]) > 0)
-          trans_scaling_factor = collision_trans_speed_ / (fabs(desired_vel[1]));
-
-        if(fabs(desired_vel[2]) > 0)
-          rot_scaling_factor = collision_rot_speed_ / (fabs(desired_vel[2]));
-
-        if(collision_trans_speed_ > 0.0 && collision_rot_speed_ > 0.0)
-          scaling_factor = std::min(trans_scaling_factor, rot_scaling_factor);
-        else if(collision_trans_speed_ > 0.0)
-          scaling_factor = trans_scaling_factor;
-        else if(collision_rot_speed_ > 0.0)
-          scaling_factor = rot_scaling_factor;
-
-        //apply the scaling factor
-        best = scaling_factor * best;
+    sample_legal_.assign(samples_.size(), false);
+    if(sampling_mode_ == "nearest_first")
+      checkNearestFirst();
+    else if(sampling_mode_ == "coarse_to_fine")
+      checkCoarseToFine();
+    else{
+      to_check_.resize(samples_.size());
+      for(unsigned int i = 0; i < to_check_.size(); ++i)
+        to_check_[i] = i;
+      checkSamples(0, to_check_.size());
+    }
+
+    //going through the samples in order picks the same one no matter which thread checked what
+    for(unsigned int i = 0; i < samples_.size(); ++i){
+      if(sample_legal_[i]){
+        double sq_dist = sample_dist_[i];
+
+        //if we have a trajectory that is better than our best one so far, we'll take it
+        if(sq_dist < best_dist){
+          best = samples_[i];
+          best_dist = sq_dist;
+          trajectory_found = true;
+        }
       }
+    }
 
-      geometry_msgs::Twist best_cmd;
-      best_cmd.linear.x = best[0];
-      best_cmd.linear.y = best[1];
-      best_cmd.angular.z = best[2];
-      pub_.publish(best_cmd);
+    //check if best is still zero, if it is... scale the original trajectory based on the collision_speed requested
+    //but we only need to do this if the user has set a non-zero collision speed
+    if(!trajectory_found && (collision_trans_speed_ > 0.0 || collision_rot_speed_ > 0.0)){
+      double trans_scaling_factor = 0.0;
+      double rot_scaling_factor = 0.0;
+      double scaling_factor = 0.0;
 
-      r.sleep();
+      if(fabs(desired_vel[0]) > 0 && fabs(desired_vel[1]) > 0)
+        trans_scaling_factor = std::min(collision_trans_speed_ / fabs(desired_vel[0]), collision_trans_speed_ / fabs(desired_vel[1]));
+      else if(fabs(desired_vel[0]) > 0)
+        trans_scaling_factor = collision_trans_speed_ / (fabs(desired_vel[0]));
+      else if(fabs(desired_vel[1]) > 0)
+        trans_scaling_factor = collision_trans_speed_ / (fabs(desired_vel[1]));
+
+      if(fabs(desired_vel[2]) > 0)
+        rot_scaling_factor = collision_rot_speed_ / (fabs(desired_vel[2]));
+
+      if(collision_trans_speed_ > 0.0 && collision_rot_speed_ > 0.0)
+        scaling_factor = std::min(trans_scaling_factor, rot_scaling_factor);
+      else if(collision_trans_speed_ > 0.0)
+        scaling_factor = trans_scaling_factor;
+      else if(collision_rot_speed_ > 0.0)
+        scaling_factor = rot_scaling_factor;
+
+      //apply the scaling factor
+      best = scaling_factor * best;
     }
+
+    geometry_msgs::Twist best_cmd;
+    best_cmd.linear.x = best[0];
+    best_cmd.linear.y = best[1];
+    best_cmd.angular.z = best[2];
+    pub_.publish(best_cmd);
+    publishChecks();
   }
 };
 
@@ -0,0 +1,122 @@
+/*********************************************************************
+*
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of Willow Garage, Inc. nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*
+*********************************************************************/
+// Runs synthetic scans through the filter chain configured under
+// ~scan_filter_chain (see launch/max_range_filter_benchmark.launch) and
+// reports the latency of a chain update. A share of the beams is set to
+// infinity, NaN or beyond the range limits, so the filters have work to do.
+#include <ros/ros.h>
+#include <filters/filter_chain.h>
+#include <sensor_msgs/LaserScan.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace {
+
+// nearest rank percentile, 0 for an empty sample
+double percentile(std::vector<double> values, double p){
+  if(values.empty())
+    return 0.0;
+  std::sort(values.begin(), values.end());
+  size_t rank = std::ceil(p / 100.0 * values.size());
+  return values[std::min(std::max<size_t>(rank, 1), values.size()) - 1];
+}
+
+}
+
+int main(int argc, char** argv){
+  ros::init(argc, argv, "max_range_filter_benchmark");
+  ros::NodeHandle private_nh("~");
+
+  int beams, iterations;
+  double invalid_share;
+  bool intensities;
+  private_nh.param("beams", beams, 1081);
+  private_nh.param("iterations", iterations, 10000);
+  private_nh.param("invalid_share", invalid_share, 0.2);
+  private_nh.param("intensities", intensities, true);
+
+  filters::FilterChain<sensor_msgs::LaserScan> chain("sensor_msgs::LaserScan");
+  if(!chain.configure("scan_filter_chain", private_nh)){
+    ROS_ERROR("Failed to configure the filter chain from ~scan_filter_chain");
+    return 1;
+  }
+
+  sensor_msgs::LaserScan scan;
+  scan.header.frame_id = "base_laser_link";
+  scan.angle_min = -M_PI / 2;
+  scan.angle_max = M_PI / 2;
+  scan.angle_increment = M_PI / std::max(beams - 1, 1);
+  scan.time_increment = 0.025 / beams;
+  scan.scan_time = 0.025;
+  scan.range_min = 0.05;
+  scan.range_max = 30.0;
+  scan.ranges.resize(beams);
+  if(intensities)
+    scan.intensities.assign(beams, 1000.0f);
+
+  // spread the invalid beams over the scan instead of lumping them together
+  const float special[] = {std::numeric_limits<float>::infinity(), std::numeric_limits<float>::quiet_NaN(),
+                           scan.range_max + 1.0f, 0.0f};
+  unsigned int invalid = 0;
+  for(int i = 0; i < beams; ++i){
+    if(invalid < invalid_share * (i + 1))
+      scan.ranges[i] = special[invalid++ % 4];
+    else
+      scan.ranges[i] = 1.0f + 10.0f * (i % 97) / 97.0f;
+  }
+
+  // the output scan is kept across updates, as a node running the chain would
+  sensor_msgs::LaserScan filtered_scan;
+  std::vector<double> latency;
+  latency.reserve(iterations);
+  for(int i = 0; i < iterations && ros::ok(); ++i){
+    scan.header.stamp = ros::Time::now();
+    ros::WallTime start = ros::WallTime::now();
+    if(!chain.update(scan, filtered_scan)){
+      ROS_ERROR("The filter chain failed to update");
+      return 1;
+    }
+    latency.push_back((ros::WallTime::now() - start).toSec() * 1e6);
+  }
+
+  printf("%d scans of %d beams (%.0f%% invalid)\n", (int)latency.size(), beams, 100.0 * invalid_share);
+  printf("update latency [us]: p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+         percentile(latency, 50), percentile(latency, 90), percentile(latency, 99), percentile(latency, 100));
+  return 0;
+}
@@ -39,14 +39,32 @@
 #include <nav_core/base_global_planner.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <costmap_2d/costmap_2d_ros.h>
+#include <base_local_planner/costmap_model.h>
+#include <sbpl_lattice_planner/sbpl_lattice_planner.h>
 
 namespace goal_passer {
   class GoalPasser : public nav_core::BaseGlobalPlanner {
     public:
-      GoalPasser() {}
-      void initialize(std::string name, costmap_2d::Costmap2DROS* costmap_ros) {}
+      GoalPasser();
+      ~GoalPasser();
+      void initialize(std::string name, costmap_2d::Costmap2DROS* costmap_ros);
       bool makePlan(const geometry_msgs::PoseStamped& start,
           const geometry_msgs::PoseStamped& goal, std::vector<geometry_msgs::PoseStamped>& plan);
+
+    private:
+      bool makeStraightPlan(const geometry_msgs::PoseStamped& start,
+          const geometry_msgs::PoseStamped& goal, std::vector<geometry_msgs::PoseStamped>& plan);
+      bool addPose(double x, double y, double theta, const std::vector<geometry_msgs::Point>& footprint,
+          std::vector<geometry_msgs::PoseStamped>& plan);
+
+      costmap_2d::Costmap2DROS* costmap_ros_;
+      base_local_planner::CostmapModel* world_model_;
+      sbpl_lattice_planner::SBPLLatticePlanner sbpl_planner_;
+
+      //only check the straight line to the goal and fall back to sbpl if these are set
+      bool straight_line_, fallback_to_sbpl_;
+      double max_straight_line_distance_, path_resolution_, angular_resolution_;
+      int max_cost_;
   };
 };
 #endif
@@ -36,15 +36,128 @@
 *********************************************************************/
 #include <goal_passer/goal_passer.h>
 #include <pluginlib/class_list_macros.hpp>
+#include <costmap_2d/cost_values.h>
+#include <tf2/LinearMath/Quaternion.h>
+#include <cmath>
 
 //register this planner as a BaseGlobalPlanner plugin
 PLUGINLIB_EXPORT_CLASS(goal_passer::GoalPasser, nav_core::BaseGlobalPlanner)
 
 namespace goal_passer {
+  GoalPasser::GoalPasser() : costmap_ros_(NULL), world_model_(NULL), straight_line_(false), fallback_to_sbpl_(false) {}
+
+  GoalPasser::~GoalPasser(){
+    delete world_model_;
+  }
+
+  void GoalPasser::initialize(std::string name, costmap_2d::Costmap2DROS* costmap_ros){
+    costmap_ros_ = costmap_ros;
+    ros::NodeHandle private_nh("~/" + name);
+
+    private_nh.param("straight_line", straight_line_, false);
+    private_nh.param("fallback_to_sbpl", fallback_to_sbpl_, false);
+    private_nh.param("max_straight_line_distance", max_straight_line_distance_, 3.0);
+    private_nh.param("path_resolution", path_resolution_, costmap_ros_->getCostmap()->getResolution());
+    private_nh.param("angular_resolution", angular_resolution_, 0.1);
+    private_nh.param("max_cost", max_cost_, (int)costmap_2d::INSCRIBED_INFLATED_OBSTACLE);
+
+    //the straight line is split into steps of these sizes, so they have to be positive
+    if(!(path_resolution_ > 0.0)){
+      ROS_WARN("path_resolution must be positive, using the costmap resolution instead of %f", path_resolution_);
+      path_resolution_ = costmap_ros_->getCostmap()->getResolution();
+    }
+    if(!(angular_resolution_ > 0.0)){
+      ROS_WARN("angular_resolution must be positive, using 0.1 instead of %f", angular_resolution_);
+      angular_resolution_ = 0.1;
+    }
+
+    if(straight_line_)
+      world_model_ = new base_local_planner::CostmapModel(*costmap_ros_->getCostmap());
+    if(straight_line_ && fallback_to_sbpl_)
+      sbpl_planner_.initialize(name + "/sbpl_lattice_planner", costmap_ros_);
+  }
+
   bool GoalPasser::makePlan(const geometry_msgs::PoseStamped& start, 
       const geometry_msgs::PoseStamped& goal, std::vector<geometry_msgs::PoseStamped>& plan){
     plan.clear();
-    plan.push_back(goal);
+    if(!straight_line_){
+      plan.push_back(goal);
+      return true;
+    }
+
+    if(makeStraightPlan(start, goal, plan))
+      return true;
+    plan.clear();
+
+    if(!fallback_to_sbpl_)
+      return false;
+    ROS_DEBUG("The straight line to the goal is blocked, calling the sbpl planner");
+    return sbpl_planner_.makePlan(start, goal, plan);
+  }
+
+  bool GoalPasser::makeStraightPlan(const geometry_msgs::PoseStamped& start,
+      const geometry_msgs::PoseStamped& goal, std::vector<geometry_msgs::PoseStamped>& plan){
+    double dx = goal.pose.position.x - start.pose.position.x;
+    double dy = goal.pose.position.y - start.pose.position.y;
+    double dist = hypot(dx, dy);
+    if(dist > max_straight_line_distance_)
+      return false;
+
+    //we turn in place to face along the line, drive along it, and turn in place to the goal orientation...
+    //sweeping the footprint over every pose of the plan on the way
+    std::vector<geometry_msgs::Point> footprint = costmap_ros_->getRobotFootprint();
+    double start_theta = 2 * atan2(start.pose.orientation.z, start.pose.orientation.w);
+    double goal_theta = 2 * atan2(goal.pose.orientation.z, goal.pose.orientation.w);
+    double line_theta = dist > path_resolution_ ? atan2(dy, dx) : start_theta;
+
+    if(!addPose(start.pose.position.x, start.pose.position.y, start_theta, footprint, plan))
+      return false;
+
+    double turn = std::remainder(line_theta - start_theta, 2 * M_PI);
+    int steps = ceil(fabs(turn) / angular_resolution_);
+    for(int i = 1; i <= steps; ++i){
+      if(!addPose(start.pose.position.x, start.pose.position.y, start_theta + turn * i / steps, footprint, plan))
+        return false;
+    }
+
+    steps = ceil(dist / path_resolution_);
+    for(int i = 1; i <= steps; ++i){
+      if(!addPose(start.pose.position.x + dx * i / steps, start.pose.position.y + dy * i / steps, line_theta, footprint, plan))
+        return false;
+    }
+
+    turn = std::remainder(goal_theta - line_theta, 2 * M_PI);
+    steps = ceil(fabs(turn) / angular_resolution_);
+    for(int i = 1; i <= steps; ++i){
+      if(!addPose(goal.pose.position.x, goal.pose.position.y, line_theta + turn * i / steps, footprint, plan))
+        return false;
+    }
+
+    //end on exactly the pose we were asked to go to
+    plan.back().pose.orientation = goal.pose.orientation;
+    ROS_DEBUG("Planned a straight line with %u poses to the goal", (unsigned int)plan.size());
+    return true;
+  }
+
+  bool GoalPasser::addPose(double x, double y, double theta, const std::vector<geometry_msgs::Point>& footprint,
+      std::vector<geometry_msgs::PoseStamped>& plan){
+    double cost = world_model_->footprintCost(x, y, theta, footprint, 0.0, 0.0);
+    if(cost < 0 || cost >= max_cost_)
+      return false;
+
+    geometry_msgs::PoseStamped pose;
+    pose.header.stamp = ros::Time::now();
+    pose.header.frame_id = costmap_ros_->getGlobalFrameID();
+    pose.pose.position.x = x;
+    pose.pose.position.y = y;
+
+    tf2::Quaternion temp;
+    temp.setRPY(0, 0, theta);
+    pose.pose.orientation.x = temp.getX();
+    pose.pose.orientation.y = temp.getY();
+    pose.pose.orientation.z = temp.getZ();
+    pose.pose.orientation.w = temp.getW();
+    plan.push_back(pose);
     return true;
   }
 };
@@ -0,0 +1,82 @@
+/*********************************************************************
+*
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of Willow Garage, Inc. nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*
+*********************************************************************/
+#ifndef POSE_BASE_CONTROLLER_ODOMETRY_STATE_H_
+#define POSE_BASE_CONTROLLER_ODOMETRY_STATE_H_
+#include <ros/ros.h>
+#include <nav_msgs/Odometry.h>
+#include <pose_base_controller/seqlock.h>
+
+namespace pose_base_controller {
+  //the latest base velocity from odometry... written by the odometry callback and read by
+  //the controller without taking a lock, only the twist is kept since that's all we look at
+  class OdometryState {
+    public:
+      void update(const nav_msgs::Odometry& msg){
+        update(msg.twist.twist.linear.x, msg.twist.twist.linear.y, msg.twist.twist.angular.z, ros::Time::now());
+      }
+
+      void update(double x, double y, double th, const ros::Time& received){
+        state_.write({{x, y, th, received.toSec()}});
+      }
+
+      //returns the time the velocity was received, zero if no odometry came in yet
+      ros::Time read(double& x, double& y, double& th) const {
+        State::Values values;
+        state_.read(values);
+        x = values[0];
+        y = values[1];
+        th = values[2];
+        return ros::Time(values[3]);
+      }
+
+      ros::Time lastReceived() const {
+        return ros::Time(state_.get(3));
+      }
+
+      bool stopped(double trans_stopped_velocity, double rot_stopped_velocity) const {
+        double x, y, th;
+        read(x, y, th);
+        return fabs(th) <= rot_stopped_velocity
+          && fabs(x) <= trans_stopped_velocity
+          && fabs(y) <= trans_stopped_velocity;
+      }
+
+    private:
+      typedef SeqLock<double, 4> State; /**< x, y, th and the receive time in seconds */
+      State state_;
+  };
+};
+#endif
@@ -45,17 +45,39 @@
 #include <tf2_ros/transform_listener.h>
 #include <actionlib/server/simple_action_server.h>
 #include <move_base_msgs/MoveBaseAction.h>
+#include <pose_base_controller/PoseSequenceAction.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <geometry_msgs/Pose.h>
 #include <geometry_msgs/Twist.h>
 #include <nav_msgs/Odometry.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <pose_base_controller/odometry_state.h>
 
 #include <boost/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <vector>
 
 namespace pose_base_controller {
+  //timing of the control loop cycles since the last diagnostics message, all times in seconds
+  struct LoopStatistics {
+    LoopStatistics() { reset(); }
+
+    void reset(){
+      cycles = missed_deadlines = 0;
+      lookup_sum = lookup_max = compute_sum = compute_max = jitter_max = 0.0;
+    }
+
+    unsigned int cycles, missed_deadlines;
+    double lookup_sum, lookup_max;
+    double compute_sum, compute_max;
+    double jitter_max;
+  };
+
   class PoseBaseController {
     private:
       typedef actionlib::SimpleActionServer<move_base_msgs::MoveBaseAction> MoveBaseActionServer;
+      typedef actionlib::SimpleActionServer<pose_base_controller::PoseSequenceAction> PoseSequenceActionServer;
 
     public:
       PoseBaseController();
@@ -63,7 +85,11 @@ namespace pose_base_controller {
       ~PoseBaseController() {}
 
       void execute(const move_base_msgs::MoveBaseGoalConstPtr& user_goal);
+      void executeSequence(const pose_base_controller::PoseSequenceGoalConstPtr& sequence);
       bool controlLoop(const move_base_msgs::MoveBaseGoal& current_goal);
+      bool followPoses(const std::vector<tf2::Stamped<tf2::Transform> >& targets,
+          const boost::function<bool()>& preempt_requested, const boost::function<void(unsigned int)>& progress,
+          unsigned int goal_id);
       tf2::Stamped<tf2::Transform> getRobotPose();
 
       inline double sign(double n){
@@ -74,26 +100,37 @@ namespace pose_base_controller {
       geometry_msgs::Twist limitTwist(const geometry_msgs::Twist& twist);
       double headingDiff(double pt_x, double pt_y, double x, double y, double heading);
       move_base_msgs::MoveBaseGoal goalToFixedFrame(const move_base_msgs::MoveBaseGoal& goal);
+      void publishDiagnostics(const LoopStatistics& stats);
 
     private:
       void odomCallback(const nav_msgs::Odometry::ConstPtr& msg);
       bool stopped();
+      void setRealtimePriority();
+      void waitForStop();
+      void publishSequenceFeedback(unsigned int current_pose);
 
       MoveBaseActionServer action_server_;
+      PoseSequenceActionServer sequence_server_;
+      boost::mutex control_mutex_;
+      std::atomic<unsigned int> goal_id_;
       tf2_ros::Buffer tf_;
       tf2_ros::TransformListener tfl_;
       ros::Publisher vel_pub_;
+      ros::Publisher diagnostics_pub_;
       double K_trans_, K_rot_, tolerance_trans_, tolerance_rot_;
       double tolerance_timeout_, freq_;
       double max_vel_lin_, max_vel_th_;
       double min_vel_lin_, min_vel_th_;
       double min_in_place_vel_th_, in_place_trans_vel_;
       double transform_tolerance_;
+      double blend_distance_;
+      double diagnostics_period_;
+      bool monotonic_clock_;
+      int realtime_priority_;
       std::string fixed_frame_, base_frame_;
       bool holonomic_;
-      boost::mutex odom_lock_;
       ros::Subscriber odom_sub_;
-      nav_msgs::Odometry base_odom_;
+      OdometryState odom_state_;
       double trans_stopped_velocity_, rot_stopped_velocity_;
   };
 };
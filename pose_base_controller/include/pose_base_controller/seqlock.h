@@ -0,0 +1,99 @@
+/*********************************************************************
+*
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2009, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of Willow Garage, Inc. nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*
+*********************************************************************/
+#ifndef POSE_BASE_CONTROLLER_SEQLOCK_H_
+#define POSE_BASE_CONTROLLER_SEQLOCK_H_
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace pose_base_controller {
+  /**
+   * @brief N values of type T that one thread writes and any number of threads read, without locking
+   *
+   * There must only ever be one writer at a time. Readers never block the writer; they retry
+   * when a write came in while they were reading, and always get a set of values that was
+   * written together. The values are atomics themselves, so T has to be trivially copyable.
+   */
+  template <typename T, std::size_t N>
+  class SeqLock {
+    public:
+      typedef std::array<T, N> Values;
+
+      explicit SeqLock(const T& initial = T()) : seq_(0) {
+        for(std::size_t i = 0; i < N; ++i)
+          values_[i].store(initial, std::memory_order_relaxed);
+      }
+
+      void write(const Values& values){
+        //an odd sequence number tells readers that a write is in progress
+        unsigned int seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for(std::size_t i = 0; i < N; ++i)
+          values_[i].store(values[i], std::memory_order_relaxed);
+        seq_.store(seq + 2, std::memory_order_release);
+      }
+
+      /**
+       * @return The sequence number of the values that were read, it changes with every write
+       */
+      unsigned int read(Values& values) const {
+        //try again if a write came in between, there is only one writer so this does not take long
+        while(true){
+          unsigned int seq = seq_.load(std::memory_order_acquire);
+          if(seq & 1)
+            continue;
+          for(std::size_t i = 0; i < N; ++i)
+            values[i] = values_[i].load(std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if(seq_.load(std::memory_order_relaxed) == seq)
+            return seq;
+        }
+      }
+
+      /**
+       * @brief Read a single value, on its own it needs no retry
+       */
+      T get(std::size_t i) const {
+        return values_[i].load(std::memory_order_acquire);
+      }
+
+    private:
+      std::atomic<unsigned int> seq_;
+      std::array<std::atomic<T>, N> values_;
+  };
+};
+#endif
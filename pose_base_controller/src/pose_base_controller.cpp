@@ -35,13 +35,23 @@
 * Author: Eitan Marder-Eppstein
 *********************************************************************/
 #include <pose_base_controller/pose_base_controller.h>
+#include <algorithm>
+#include <cstring>
+#include <pthread.h>
+#include <sstream>
+#include <thread>
 
 namespace pose_base_controller {
 PoseBaseController::PoseBaseController() : tfl_(tf_),
                                            action_server_(ros::NodeHandle(),
                                                           "pose_base_controller",
                                         boost::bind(&PoseBaseController::execute, this, _1),
-                                                          false) {
+                                                          false),
+                                           sequence_server_(ros::NodeHandle(),
+                                                            "pose_sequence",
+                                        boost::bind(&PoseBaseController::executeSequence, this, _1),
+                                                            false),
+                                           goal_id_(0) {
     ros::NodeHandle node_private("~");
     node_private.param("k_trans", K_trans_, 1.0);
     node_private.param("k_rot", K_rot_, 1.0);
@@ -65,25 +75,34 @@ PoseBaseController::PoseBaseController() : tfl_(tf_),
     node_private.param("frequency", freq_, 100.0);
     node_private.param("transform_tolerance", transform_tolerance_, 0.5);
 
+    //schedule the control loop on the monotonic clock instead of ros time, and optionally with real-time priority
+    node_private.param("monotonic_clock", monotonic_clock_, false);
+    node_private.param("realtime_priority", realtime_priority_, 0);
+    node_private.param("diagnostics_period", diagnostics_period_, 1.0);
+
+    //when following a pose sequence, move on to the next pose once this close to the current one... or,
+    //if zero, once the current one is within the tolerances
+    node_private.param("blend_distance", blend_distance_, 0.0);
+
     node_private.param("trans_stopped_velocity", trans_stopped_velocity_, 1e-4);
     node_private.param("rot_stopped_velocity", rot_stopped_velocity_, 1e-4);
 
     ros::NodeHandle node;
     odom_sub_ = node.subscribe<nav_msgs::Odometry>("odom", 1, boost::bind(&PoseBaseController::odomCallback, this, _1));
     vel_pub_ = node.advertise<geometry_msgs::Twist>("base_controller/command", 10);
+    if(diagnostics_period_ > 0.0)
+      diagnostics_pub_ = node.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 1);
 
     action_server_.start();
+    sequence_server_.start();
     ROS_DEBUG("Started server");
   }
 
   void PoseBaseController::odomCallback(const nav_msgs::Odometry::ConstPtr& msg){
     //we assume that the odometry is published in the frame of the base
-    boost::mutex::scoped_lock lock(odom_lock_);
-    base_odom_.twist.twist.linear.x = msg->twist.twist.linear.x;
-    base_odom_.twist.twist.linear.y = msg->twist.twist.linear.y;
-    base_odom_.twist.twist.angular.z = msg->twist.twist.angular.z;
+    odom_state_.update(*msg);
     ROS_DEBUG("In the odometry callback with velocity values: (%.2f, %.2f, %.2f)",
-        base_odom_.twist.twist.linear.x, base_odom_.twist.twist.linear.y, base_odom_.twist.twist.angular.z);
+        msg->twist.twist.linear.x, msg->twist.twist.linear.y, msg->twist.twist.angular.z);
   }
 
   double PoseBaseController::headingDiff(double x, double y, double pt_x, double pt_y, double heading)
@@ -103,18 +122,61 @@ PoseBaseController::PoseBaseController() : tfl_(tf_),
   }
 
   tf2::Stamped<tf2::Transform> PoseBaseController::getRobotPose(){
-    geometry_msgs::PoseStamped global_pose, robot_pose;
-    robot_pose.pose.orientation.w = 1.0;
-    robot_pose.header.frame_id = base_frame_;
-
-    tf_.transform(robot_pose, global_pose, fixed_frame_);
-    //ROS_INFO("Delay: %f", (global_pose.header.stamp - ros::Time::now()).toSec());
+    //the pose of the base in the fixed frame is just the latest transform between them
+    geometry_msgs::TransformStamped transform = tf_.lookupTransform(fixed_frame_, base_frame_, ros::Time());
+    //ROS_INFO("Delay: %f", (transform.header.stamp - ros::Time::now()).toSec());
 
     tf2::Stamped<tf2::Transform> global_pose_tf;
-    tf2::fromMsg(global_pose, global_pose_tf);
+    tf2::convert(transform, global_pose_tf);
     return global_pose_tf;
   }
 
+  void PoseBaseController::setRealtimePriority(){
+    sched_param param;
+    param.sched_priority = realtime_priority_;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if(err != 0)
+      ROS_WARN_ONCE("Could not run the control loop with real-time priority %d: %s", realtime_priority_, strerror(err));
+  }
+
+  void PoseBaseController::publishDiagnostics(const LoopStatistics& stats){
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = ros::this_node::getName() + ": Control loop";
+    if(stats.missed_deadlines > 0){
+      status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      status.message = "Missed deadlines";
+    }
+    else{
+      status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      status.message = "OK";
+    }
+
+    //times are reported in milliseconds
+    double cycles = std::max(stats.cycles, 1u);
+    const std::pair<std::string, double> values[] = {
+      std::make_pair("Cycles", stats.cycles),
+      std::make_pair("Missed deadlines", stats.missed_deadlines),
+      std::make_pair("Mean tf lookup time", 1e3 * stats.lookup_sum / cycles),
+      std::make_pair("Max tf lookup time", 1e3 * stats.lookup_max),
+      std::make_pair("Mean compute time", 1e3 * stats.compute_sum / cycles),
+      std::make_pair("Max compute time", 1e3 * stats.compute_max),
+      std::make_pair("Max jitter", 1e3 * stats.jitter_max)
+    };
+    for(unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); ++i){
+      diagnostic_msgs::KeyValue kv;
+      kv.key = values[i].first;
+      std::ostringstream ss;
+      ss << values[i].second;
+      kv.value = ss.str();
+      status.values.push_back(kv);
+    }
+
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    msg.status.push_back(status);
+    diagnostics_pub_.publish(msg);
+  }
+
   move_base_msgs::MoveBaseGoal PoseBaseController::goalToFixedFrame(const move_base_msgs::MoveBaseGoal& goal){
     move_base_msgs::MoveBaseGoal fixed_goal;
     geometry_msgs::PoseStamped pose;
@@ -139,19 +201,20 @@ PoseBaseController::PoseBaseController() : tfl_(tf_),
   void PoseBaseController::execute(const move_base_msgs::MoveBaseGoalConstPtr& user_goal){
     bool success = false;
 
+    //a goal on either action server ends the control loop of the other one
+    unsigned int goal_id = ++goal_id_;
+    boost::mutex::scoped_lock lock(control_mutex_);
+
     move_base_msgs::MoveBaseGoal goal = goalToFixedFrame(*user_goal);
 
-    success = controlLoop(goal);
+    std::vector<tf2::Stamped<tf2::Transform> > targets(1);
+    tf2::convert(goal.target_pose, targets[0]);
+    success = followPoses(targets, boost::bind(&MoveBaseActionServer::isPreemptRequested, &action_server_),
+        boost::function<void(unsigned int)>(), goal_id);
 
     //based on the control loop's exit status... we'll set our goal status
     if(success){
-      //wait until we're stopped before returning success
-      ros::Rate r(10.0);
-      while(!stopped()){
-        geometry_msgs::Twist empty_twist;
-        vel_pub_.publish(empty_twist);
-        r.sleep();
-      }
+      waitForStop();
       action_server_.setSucceeded();
     }
     else{
@@ -163,32 +226,96 @@ PoseBaseController::PoseBaseController() : tfl_(tf_),
     }
   }
 
-  bool PoseBaseController::stopped(){
-    //copy over the odometry information
-    nav_msgs::Odometry base_odom;
-    {
-      boost::mutex::scoped_lock lock(odom_lock_);
-      base_odom = base_odom_;
+  void PoseBaseController::executeSequence(const pose_base_controller::PoseSequenceGoalConstPtr& sequence){
+    unsigned int goal_id = ++goal_id_;
+    boost::mutex::scoped_lock lock(control_mutex_);
+
+    if(sequence->poses.empty()){
+      ROS_ERROR("Received an empty pose sequence");
+      sequence_server_.setAborted();
+      return;
+    }
+
+    std::vector<tf2::Stamped<tf2::Transform> > targets(sequence->poses.size());
+    for(unsigned int i = 0; i < sequence->poses.size(); ++i){
+      move_base_msgs::MoveBaseGoal goal;
+      goal.target_pose = sequence->poses[i];
+      tf2::convert(goalToFixedFrame(goal).target_pose, targets[i]);
+    }
+
+    bool success = followPoses(targets, boost::bind(&PoseSequenceActionServer::isPreemptRequested, &sequence_server_),
+        boost::bind(&PoseBaseController::publishSequenceFeedback, this, _1), goal_id);
+
+    if(success){
+      waitForStop();
+      sequence_server_.setSucceeded();
+    }
+    else{
+      if(sequence_server_.isPreemptRequested())
+        sequence_server_.setPreempted();
+      else
+        sequence_server_.setAborted();
+    }
+  }
+
+  void PoseBaseController::publishSequenceFeedback(unsigned int current_pose){
+    pose_base_controller::PoseSequenceFeedback feedback;
+    feedback.current_pose = current_pose;
+    sequence_server_.publishFeedback(feedback);
+  }
+
+  void PoseBaseController::waitForStop(){
+    //wait until we're stopped before returning success
+    ros::Rate r(10.0);
+    while(!stopped()){
+      geometry_msgs::Twist empty_twist;
+      vel_pub_.publish(empty_twist);
+      r.sleep();
     }
+  }
 
-    return fabs(base_odom.twist.twist.angular.z) <= rot_stopped_velocity_
-      && fabs(base_odom.twist.twist.linear.x) <= trans_stopped_velocity_
-      && fabs(base_odom.twist.twist.linear.y) <= trans_stopped_velocity_;
+  bool PoseBaseController::stopped(){
+    return odom_state_.stopped(trans_stopped_velocity_, rot_stopped_velocity_);
   }
 
   bool PoseBaseController::controlLoop(const move_base_msgs::MoveBaseGoal& current_goal){
-    if(freq_ == 0.0)
+    std::vector<tf2::Stamped<tf2::Transform> > targets(1);
+    tf2::convert(current_goal.target_pose, targets[0]);
+    return followPoses(targets, boost::bind(&MoveBaseActionServer::isPreemptRequested, &action_server_),
+        boost::function<void(unsigned int)>(), goal_id_);
+  }
+
+  bool PoseBaseController::followPoses(const std::vector<tf2::Stamped<tf2::Transform> >& targets,
+      const boost::function<bool()>& preempt_requested, const boost::function<void(unsigned int)>& progress,
+      unsigned int goal_id){
+    if(freq_ == 0.0 || targets.empty())
       return false;
 
+    if(realtime_priority_ > 0)
+      setRealtimePriority();
+
+    //the targets are already in the fixed frame, so they only need to be converted once
+    unsigned int current_target = 0;
+    if(progress)
+      progress(current_target);
+
+    typedef std::chrono::steady_clock clock;
+    const clock::duration period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / freq_));
+    clock::time_point deadline = clock::now();
+    clock::time_point last_diagnostics = deadline;
+    LoopStatistics stats;
+
     ros::Rate r(freq_);
     ros::Time goal_reached_time = ros::Time::now();
     while(ros::ok()){
-      if(action_server_.isPreemptRequested()){
+      //how late this cycle starts compared to when it was meant to
+      clock::time_point cycle_start = clock::now();
+      stats.jitter_max = std::max(stats.jitter_max, fabs(std::chrono::duration<double>(cycle_start - deadline).count()));
+
+      if(preempt_requested() || goal_id_ != goal_id){
         return false;
       }
       ROS_DEBUG("At least looping");
-      tf2::Stamped<tf2::Transform> target_pose;
-      tf2::convert(current_goal.target_pose, target_pose);
 
       //get the current pose of the robot in the fixed frame
       tf2::Stamped<tf2::Transform> robot_pose;
@@ -209,6 +336,9 @@ PoseBaseController::PoseBaseController() : tfl_(tf_),
         vel_pub_.publish(empty_twist);
         return false;
       }
+      clock::time_point lookup_end = clock::now();
+
+      const tf2::Stamped<tf2::Transform>& target_pose = targets[current_target];
       ROS_DEBUG("PoseBaseController: current robot pose %f %f ==> %f", robot_pose.getOrigin().x(), robot_pose.getOrigin().y(), tf2::getYaw(robot_pose.getRotation()));
       ROS_DEBUG("PoseBaseController: target robot pose %f %f ==> %f", target_pose.getOrigin().x(), target_pose.getOrigin().y(), tf2::getYaw(target_pose.getRotation()));
 
@@ -219,8 +349,22 @@ PoseBaseController::PoseBaseController() : tfl_(tf_),
       //publish the desired velocity command to the base
       vel_pub_.publish(limitTwist(diff));
 
+      bool in_tolerance = fabs(diff.linear.x) <= tolerance_trans_ && fabs(diff.linear.y) <= tolerance_trans_ && fabs(diff.angular.z) <= tolerance_rot_;
+
+      //we don't stop at the poses before the last one... just move on to the next once we're close enough
+      if(current_target + 1 < targets.size()){
+        bool reached = blend_distance_ > 0.0 ? hypot(diff.linear.x, diff.linear.y) <= blend_distance_ : in_tolerance;
+        if(reached){
+          ++current_target;
+          ROS_DEBUG("PoseBaseController: moving on to pose %u of %u", current_target, (unsigned int)targets.size());
+          if(progress)
+            progress(current_target);
+        }
+        in_tolerance = false;
+      }
+
       //if we haven't reached our goal... we'll update time
-      if (fabs(diff.linear.x) > tolerance_trans_ || fabs(diff.linear.y) > tolerance_trans_ || fabs(diff.angular.z) > tolerance_rot_)
+      if (!in_tolerance)
         goal_reached_time = ros::Time::now();
 
       //check if we've reached our goal for long enough to succeed
@@ -230,7 +374,32 @@ PoseBaseController::PoseBaseController() : tfl_(tf_),
         return true;
       }
 
-      r.sleep();
+      clock::time_point cycle_end = clock::now();
+      double lookup_time = std::chrono::duration<double>(lookup_end - cycle_start).count();
+      double compute_time = std::chrono::duration<double>(cycle_end - lookup_end).count();
+      stats.cycles++;
+      stats.lookup_sum += lookup_time;
+      stats.lookup_max = std::max(stats.lookup_max, lookup_time);
+      stats.compute_sum += compute_time;
+      stats.compute_max = std::max(stats.compute_max, compute_time);
+
+      deadline += period;
+      if(cycle_end > deadline){
+        //don't try to catch up on the cycles we missed
+        stats.missed_deadlines++;
+        deadline = cycle_end;
+      }
+
+      if(diagnostics_period_ > 0.0 && std::chrono::duration<double>(cycle_end - last_diagnostics).count() >= diagnostics_period_){
+        publishDiagnostics(stats);
+        stats.reset();
+        last_diagnostics = cycle_end;
+      }
+
+      if(monotonic_clock_)
+        std::this_thread::sleep_until(deadline);
+      else
+        r.sleep();
     }
     return false;
   }
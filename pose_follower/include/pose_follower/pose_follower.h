@@ -51,6 +51,7 @@
 #include <pose_follower/PoseFollowerConfig.h>
 #include <dynamic_reconfigure/server.h>
 #include <base_local_planner/trajectory_planner_ros.h>
+#include <pose_base_controller/odometry_state.h>
 
 namespace pose_follower {
   class PoseFollower : public nav_core::BaseLocalPlanner {
@@ -69,11 +70,17 @@ namespace pose_follower {
 
       geometry_msgs::Twist diff2D(const geometry_msgs::Pose& pose1, const geometry_msgs::Pose&  pose2);
       geometry_msgs::Twist limitTwist(const geometry_msgs::Twist& twist);
+
+      bool bisectScaling(const geometry_msgs::Twist& limit_vel, geometry_msgs::Twist& legal_vel);
       double headingDiff(double pt_x, double pt_y, double x, double y, double heading);
 
-      bool transformGlobalPlan(const tf2_ros::Buffer& tf, const std::vector<geometry_msgs::PoseStamped>& global_plan,
-          const costmap_2d::Costmap2DROS& costmap, const std::string& global_frame,
-          std::vector<geometry_msgs::PoseStamped>& transformed_plan);
+      bool lookupPlanTransform(const tf2_ros::Buffer& tf, const std::vector<geometry_msgs::PoseStamped>& global_plan,
+          const std::string& global_frame, tf2::Stamped<tf2::Transform>& plan_transform);
+
+      //the i-th pose of the global plan in the global frame of the costmap, transformed on first use
+      const geometry_msgs::PoseStamped& planPose(unsigned int i);
+      void transformPlan(unsigned int end);
+      void skipToClosestWaypoint(const geometry_msgs::PoseStamped& robot_pose);
 
       void odomCallback(const nav_msgs::Odometry::ConstPtr& msg);
       bool stopped();
@@ -83,12 +90,14 @@ namespace pose_follower {
       tf2_ros::Buffer *tf_;
       costmap_2d::Costmap2DROS *costmap_ros_;
       ros::Publisher global_plan_pub_;
-      boost::mutex odom_lock_;
       ros::Subscriber odom_sub_;
-      nav_msgs::Odometry base_odom_;
+      pose_base_controller::OdometryState odom_state_;
       ros::Time goal_reached_time_;
       unsigned int current_waypoint_;
-      std::vector<geometry_msgs::PoseStamped> global_plan_;
+      std::vector<geometry_msgs::PoseStamped> global_plan_; //as received, in the frame of the planner
+      std::vector<geometry_msgs::PoseStamped> transformed_plan_; //the poses of global_plan_ transformed so far
+      std::vector<double> plan_arc_length_; //along global_plan_, up to each pose
+      tf2::Stamped<tf2::Transform> plan_transform_;
       base_local_planner::TrajectoryPlannerROS collision_planner_;
       dynamic_reconfigure::Server<pose_follower::PoseFollowerConfig> *dsrv_;
 
@@ -100,6 +109,9 @@ namespace pose_follower {
       double K_trans_, K_rot_, tolerance_trans_, tolerance_rot_;
       double tolerance_timeout_;
       int samples_;
+      bool bisect_samples_;
+      double max_waypoint_skip_distance_;
+      int plan_transform_window_;
       bool allow_backwards_;
       bool turn_in_place_first_;
       double max_heading_diff_before_moving_;
@@ -37,6 +37,8 @@
 #include <nav_msgs/Path.h>
 #include <pose_follower/pose_follower.h>
 #include <pluginlib/class_list_macros.hpp>
+#include <algorithm>
+#include <cfloat>
 
 PLUGINLIB_EXPORT_CLASS(pose_follower::PoseFollower, nav_core::BaseLocalPlanner)
 
@@ -60,6 +62,10 @@ namespace pose_follower {
     //set this to true if you're using a holonomic robot
     node_private.param("holonomic", holonomic_, true);
 
+    //how many poses of the global plan get transformed at once, as they are needed
+    node_private.param("plan_transform_window", plan_transform_window_, 100);
+    plan_transform_window_ = std::max(plan_transform_window_, 1);
+
     global_plan_pub_ = node_private.advertise<nav_msgs::Path>("global_plan", 1);
 
     ros::NodeHandle node;
@@ -89,6 +95,8 @@ namespace pose_follower {
     tolerance_timeout_ = config.tolerance_timeout;
 
     samples_ = config.samples;
+    bisect_samples_ = config.bisect_samples;
+    max_waypoint_skip_distance_ = config.max_waypoint_skip_distance;
     allow_backwards_ = config.allow_backwards;
     turn_in_place_first_ = config.turn_in_place_first;
     max_heading_diff_before_moving_ = config.max_heading_diff_before_moving;
@@ -99,12 +107,9 @@ namespace pose_follower {
 
   void PoseFollower::odomCallback(const nav_msgs::Odometry::ConstPtr& msg){
     //we assume that the odometry is published in the frame of the base
-    boost::mutex::scoped_lock lock(odom_lock_);
-    base_odom_.twist.twist.linear.x = msg->twist.twist.linear.x;
-    base_odom_.twist.twist.linear.y = msg->twist.twist.linear.y;
-    base_odom_.twist.twist.angular.z = msg->twist.twist.angular.z;
+    odom_state_.update(*msg);
     ROS_DEBUG("In the odometry callback with velocity values: (%.2f, %.2f, %.2f)",
-        base_odom_.twist.twist.linear.x, base_odom_.twist.twist.linear.y, base_odom_.twist.twist.angular.z);
+        msg->twist.twist.linear.x, msg->twist.twist.linear.y, msg->twist.twist.angular.z);
   }
 
   double PoseFollower::headingDiff(double x, double y, double pt_x, double pt_y, double heading)
@@ -124,16 +129,7 @@ namespace pose_follower {
   }
 
   bool PoseFollower::stopped(){
-    //copy over the odometry information
-    nav_msgs::Odometry base_odom;
-    {
-      boost::mutex::scoped_lock lock(odom_lock_);
-      base_odom = base_odom_;
-    }
-
-    return fabs(base_odom.twist.twist.angular.z) <= rot_stopped_velocity_
-      && fabs(base_odom.twist.twist.linear.x) <= trans_stopped_velocity_
-      && fabs(base_odom.twist.twist.linear.y) <= trans_stopped_velocity_;
+    return odom_state_.stopped(trans_stopped_velocity_, rot_stopped_velocity_);
   }
 
   void PoseFollower::publishPlan(const std::vector<geometry_msgs::PoseStamped> &path,
@@ -166,7 +162,10 @@ namespace pose_follower {
     }
 
     //we want to compute a velocity command based on our current waypoint
-    geometry_msgs::PoseStamped target_pose = global_plan_[current_waypoint_];
+    if(max_waypoint_skip_distance_ > 0.0)
+      skipToClosestWaypoint(robot_pose);
+
+    geometry_msgs::PoseStamped target_pose = planPose(current_waypoint_);
     ROS_DEBUG("PoseFollower: current robot pose %f %f ==> %f", robot_pose.pose.position.x, robot_pose.pose.position.y, tf2::getYaw(robot_pose.pose.orientation));
     ROS_DEBUG("PoseFollower: target robot pose %f %f ==> %f", target_pose.pose.position.x, target_pose.pose.position.y, tf2::getYaw(target_pose.pose.orientation));
 
@@ -183,7 +182,10 @@ namespace pose_follower {
     double ds = scaling_factor / samples_;
 
     //let's make sure that the velocity command is legal... and if not, scale down
-    if(!legal_traj){
+    if(!legal_traj && bisect_samples_){
+      legal_traj = bisectScaling(limit_vel, test_vel);
+    }
+    else if(!legal_traj){
       for(int i = 0; i < samples_; ++i){
         test_vel.linear.x = limit_vel.linear.x * scaling_factor;
         test_vel.linear.y = limit_vel.linear.y * scaling_factor;
@@ -215,7 +217,7 @@ namespace pose_follower {
       if(current_waypoint_ < global_plan_.size() - 1)
       {
         current_waypoint_++;
-        target_pose = global_plan_[current_waypoint_];
+        target_pose = planPose(current_waypoint_);
         diff = diff2D(target_pose.pose, robot_pose.pose);
       }
       else
@@ -239,19 +241,106 @@ namespace pose_follower {
     return true;
   }
 
+  bool PoseFollower::bisectScaling(const geometry_msgs::Twist& limit_vel, geometry_msgs::Twist& legal_vel){
+    //the unscaled command is illegal, and we assume that any scaling below a legal one is legal as well...
+    //so we can bisect for the largest legal one of the samples_ scaling factors that the linear search tries
+    //the checks stay sequential, collision_planner_ serializes its rollouts on an internal mutex and keeps
+    //its map grids as members, so one TrajectoryPlannerROS cannot check trajectories concurrently
+    int legal = 0;
+    int illegal = samples_;
+    while(illegal - legal > 1){
+      int mid = (legal + illegal) / 2;
+      double scaling_factor = double(mid) / samples_;
+      geometry_msgs::Twist test_vel;
+      test_vel.linear.x = limit_vel.linear.x * scaling_factor;
+      test_vel.linear.y = limit_vel.linear.y * scaling_factor;
+      test_vel.angular.z = limit_vel.angular.z * scaling_factor;
+      test_vel = limitTwist(test_vel);
+      if(collision_planner_.checkTrajectory(test_vel.linear.x, test_vel.linear.y, test_vel.angular.z, false)){
+        legal = mid;
+        legal_vel = test_vel;
+      }
+      else
+        illegal = mid;
+    }
+    return legal > 0;
+  }
+
   bool PoseFollower::setPlan(const std::vector<geometry_msgs::PoseStamped>& global_plan){
     current_waypoint_ = 0;
     goal_reached_time_ = ros::Time::now();
-    if(!transformGlobalPlan(*tf_, global_plan, *costmap_ros_, costmap_ros_->getGlobalFrameID(), global_plan_)){
+    global_plan_.clear();
+    transformed_plan_.clear();
+    if(!lookupPlanTransform(*tf_, global_plan, costmap_ros_->getGlobalFrameID(), plan_transform_)){
       ROS_ERROR("Could not transform the global plan to the frame of the controller");
       return false;
     }
 
+    //the poses themselves are only transformed once we get close to them
+    global_plan_ = global_plan;
+    transformed_plan_.reserve(global_plan_.size());
+
+    //the transform is rigid, so the arc length is the same in both frames
+    plan_arc_length_.resize(global_plan_.size());
+    plan_arc_length_[0] = 0.0;
+    for(unsigned int i = 1; i < global_plan_.size(); ++i){
+      double dx = global_plan_[i].pose.position.x - global_plan_[i - 1].pose.position.x;
+      double dy = global_plan_[i].pose.position.y - global_plan_[i - 1].pose.position.y;
+      plan_arc_length_[i] = plan_arc_length_[i - 1] + sqrt(dx * dx + dy * dy);
+    }
+
     ROS_DEBUG("global plan size: %lu", global_plan_.size());
-    publishPlan(global_plan_, global_plan_pub_);
+    if(global_plan_pub_.getNumSubscribers() > 0)
+      publishPlan(global_plan_, global_plan_pub_);
     return true;
   }
 
+  const geometry_msgs::PoseStamped& PoseFollower::planPose(unsigned int i){
+    if(i >= transformed_plan_.size())
+      transformPlan(i + plan_transform_window_);
+    return transformed_plan_[i];
+  }
+
+  void PoseFollower::transformPlan(unsigned int end){
+    end = std::min(end, (unsigned int)global_plan_.size());
+    tf2::Stamped<tf2::Transform> tf_pose;
+    geometry_msgs::PoseStamped newer_pose;
+    for(unsigned int i = transformed_plan_.size(); i < end; ++i){
+      tf2::convert(global_plan_[i], tf_pose);
+      tf_pose.setData(plan_transform_ * tf_pose);
+      tf_pose.stamp_ = plan_transform_.stamp_;
+      tf_pose.frame_id_ = plan_transform_.frame_id_;
+      tf2::toMsg(tf_pose, newer_pose);
+
+      transformed_plan_.push_back(newer_pose);
+    }
+  }
+
+  void PoseFollower::skipToClosestWaypoint(const geometry_msgs::PoseStamped& robot_pose){
+    //only look at the waypoints up to max_waypoint_skip_distance_ further along the plan
+    std::vector<double>::const_iterator end = std::upper_bound(plan_arc_length_.begin() + current_waypoint_,
+        plan_arc_length_.end(), plan_arc_length_[current_waypoint_] + max_waypoint_skip_distance_);
+    unsigned int last = end - plan_arc_length_.begin() - 1;
+
+    unsigned int closest = current_waypoint_;
+    double closest_sq_dist = DBL_MAX;
+    for(unsigned int i = current_waypoint_; i <= last; ++i){
+      const geometry_msgs::Point& p = planPose(i).pose.position;
+      double dx = p.x - robot_pose.pose.position.x;
+      double dy = p.y - robot_pose.pose.position.y;
+      double sq_dist = dx * dx + dy * dy;
+      if(sq_dist < closest_sq_dist){
+        closest = i;
+        closest_sq_dist = sq_dist;
+      }
+    }
+
+    if(closest != current_waypoint_){
+      ROS_DEBUG("Skipping from waypoint %u to %u", current_waypoint_, closest);
+      current_waypoint_ = closest;
+    }
+  }
+
   bool PoseFollower::isGoalReached(){
     return goal_reached_time_ + ros::Duration(tolerance_timeout_) < ros::Time::now() && stopped();
   }
@@ -360,13 +449,8 @@ namespace pose_follower {
     return res;
   }
 
-  bool PoseFollower::transformGlobalPlan(const tf2_ros::Buffer& tf, const std::vector<geometry_msgs::PoseStamped>& global_plan,
-      const costmap_2d::Costmap2DROS& costmap, const std::string& global_frame,
-      std::vector<geometry_msgs::PoseStamped>& transformed_plan){
-    const geometry_msgs::PoseStamped& plan_pose = global_plan[0];
-
-    transformed_plan.clear();
-
+  bool PoseFollower::lookupPlanTransform(const tf2_ros::Buffer& tf, const std::vector<geometry_msgs::PoseStamped>& global_plan,
+      const std::string& global_frame, tf2::Stamped<tf2::Transform>& plan_transform){
     try{
       if (global_plan.empty())
       {
@@ -374,26 +458,13 @@ namespace pose_follower {
         return false;
       }
 
+      const geometry_msgs::PoseStamped& plan_pose = global_plan[0];
       geometry_msgs::TransformStamped transform;
       transform = tf.lookupTransform(global_frame, ros::Time(),
                                      plan_pose.header.frame_id, plan_pose.header.stamp,
                                      plan_pose.header.frame_id);
-      tf2::Stamped<tf2::Transform> tf_transform;
-      tf2::convert(transform, tf_transform);
-
-      tf2::Stamped<tf2::Transform> tf_pose;
-      geometry_msgs::PoseStamped newer_pose;
-      //now we'll transform until points are outside of our distance threshold
-      for(unsigned int i = 0; i < global_plan.size(); ++i){
-        const geometry_msgs::PoseStamped& pose = global_plan[i];
-        tf2::convert(pose, tf_pose);
-        tf_pose.setData(tf_transform * tf_pose);
-        tf_pose.stamp_ = tf_transform.stamp_;
-        tf_pose.frame_id_ = global_frame;
-        tf2::toMsg(tf_pose, newer_pose);
-
-        transformed_plan.push_back(newer_pose);
-      }
+      tf2::convert(transform, plan_transform);
+      plan_transform.frame_id_ = global_frame;
     }
     catch(tf2::LookupException& ex) {
       ROS_ERROR("No Transform available Error: %s\n", ex.what());
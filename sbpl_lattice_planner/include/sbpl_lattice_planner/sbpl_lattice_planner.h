@@ -1,6 +1,8 @@
 #ifndef SBPL_LATTICE_PLANNER_H
 #define SBPL_LATTICE_PLANNER_H
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 
@@ -9,6 +11,9 @@ using namespace std;
 // ROS
 #include <ros/ros.h>
 #include <geometry_msgs/PoseStamped.h>
+#include <boost/thread.hpp>
+#include <sbpl_lattice_planner/MakePlans.h>
+#include <sbpl_lattice_planner/SBPLLatticePlannerStats.h>
 
 // Costmap used for the map representation
 #include <costmap_2d/costmap_2d_ros.h>
@@ -57,22 +62,306 @@ public:
                         const geometry_msgs::PoseStamped& goal, 
                         std::vector<geometry_msgs::PoseStamped>& plan);
 
-  virtual ~SBPLLatticePlanner(){};
+  /**
+   * @brief Compute plans from one start to several goals, syncing the costmap only once
+   *
+   * Like makePlan, this expects the caller to hold the costmap lock.
+   * @param start The start pose
+   * @param goals The goal poses
+   * @param allocated_time The time allowed for each goal
+   * @param first_solution_only Whether to stop at the first solution instead of improving it
+   * @param plans One plan per goal, empty if no plan was found
+   * @param costs The sbpl solution cost per goal, -1 if no plan was found
+   * @param stop_at_first_plan Whether to skip the goals after the first one, in list order, that has a plan
+   * @return False if the planner could not be brought up to date, true otherwise
+   */
+  bool makePlans(const geometry_msgs::PoseStamped& start,
+                 const std::vector<geometry_msgs::PoseStamped>& goals,
+                 double allocated_time, bool first_solution_only,
+                 std::vector<std::vector<geometry_msgs::PoseStamped> >& plans,
+                 std::vector<int>& costs, bool stop_at_first_plan = false);
+
+  virtual ~SBPLLatticePlanner();
 
 private:
-  unsigned char costMapCostToSBPLCost(unsigned char newcost);
-  void publishStats(int solution_cost, int solution_size, 
+  /**
+   * @brief One planner configuration searching in its own environment
+   */
+  struct PlannerWorker{
+    PlannerWorker()
+      : initial_epsilon(3.0), forward_search(false), env(NULL), planner(NULL), solution_cost(0){
+    }
+
+    std::string name;
+    std::string planner_type;
+    double initial_epsilon;
+    bool forward_search;
+    EnvironmentNAVXYTHETALAT* env;
+    SBPLPlanner* planner;
+    boost::shared_ptr<boost::thread> thread;
+    std::vector<geometry_msgs::PoseStamped> plan; /**< solution of the last run, valid if this entry won the portfolio */
+    int solution_cost;
+    std::vector<int> solution_stateIDs; /**< reused buffers for the solution of this worker */
+    std::vector<EnvNAVXYTHETALAT3Dpt_t> sbpl_path;
+    sbpl_lattice_planner::SBPLLatticePlannerStats phase_stats; /**< phase timings of the last run */
+  };
+
+  /**
+   * @brief Linear fit of the cost of a replan over the (weighted) number of changed cells
+   *
+   * Older samples are discounted by a constant factor with every new one.
+   */
+  struct ReplanCostModel{
+    ReplanCostModel()
+      : weight(0.0), sum_x(0.0), sum_y(0.0), sum_xx(0.0), sum_xy(0.0){
+    }
+
+    void addSample(double x, double y, double decay);
+
+    /**
+     * @return False if there are no samples yet
+     */
+    bool predict(double x, double& y) const;
+
+    double weight, sum_x, sum_y, sum_xx, sum_xy;
+  };
+
+  /**
+   * @brief Create and initialize an sbpl environment for the current footprint and the given primitives
+   * @return The environment, or NULL if sbpl failed to initialize it
+   */
+  EnvironmentNAVXYTHETALAT* createEnvironment(unsigned int width, unsigned int height, const unsigned char* mapdata,
+                                              double cellsize, const std::string& primitive_filename);
+
+  /**
+   * @brief Hash everything the precomputed primitive tables depend on
+   * @return False if the primitive file cannot be read
+   */
+  bool primitiveCacheKey(const std::string& primitive_filename, const std::vector<sbpl_2Dpt_t>& perimeterptsV,
+                         double cellsize, uint64_t& key) const;
+
+  /**
+   * @brief Set up the coarse lattice of the hierarchical mode on top of the given fine mapdata
+   */
+  void createCoarseLattice(const std::vector<unsigned char>& sbpl_costs);
+
+  /**
+   * @brief Downsample fine mapdata, every coarse cell gets the highest cost of the costmap cells it covers
+   */
+  void downsampleCosts(const std::vector<unsigned char>& sbpl_costs, std::vector<unsigned char>& coarse_costs) const;
+
+  /**
+   * @brief Bring the coarse lattice up to date with the cells syncCostmap() changed in env_
+   */
+  bool syncCoarseLattice(const std::vector<nav2dcell_t>& changedcellsV, bool plan_from_scratch);
+
+  /**
+   * @brief Plan the long leg on the coarse lattice and pick the end of the part the fine lattice refines
+   * @param fine_goal Set to where the fine plan has to lead, goal itself if it is close enough
+   * @return False if there is no coarse plan, the fine lattice then plans all the way
+   */
+  bool planCoarse(const geometry_msgs::PoseStamped& start, const geometry_msgs::PoseStamped& goal,
+                  geometry_msgs::PoseStamped& fine_goal);
+
+  /**
+   * @brief Append the part of the last coarse plan that the fine plan does not cover
+   */
+  void appendCoarsePlan(std::vector<geometry_msgs::PoseStamped>& plan);
+
+  /**
+   * @brief Remember a plan and the cells its footprint sweeps for reuseCachedPlan()
+   * @param fine_size Number of poses at the beginning of the plan that come from the fine lattice
+   * @param improved Whether the plan is an improved solution of the planning thread, which is cached for
+   * the next makePlan even without reuse_plan
+   */
+  void cachePlan(const std::vector<geometry_msgs::PoseStamped>& plan, const geometry_msgs::PoseStamped& goal,
+                 int solution_cost, unsigned int fine_size, bool improved = false);
+
+  /**
+   * @brief Return the rest of the cached plan if none of the changed cells is in its way
+   * @return False if the cached plan cannot be reused, it is dropped then
+   */
+  bool reuseCachedPlan(const geometry_msgs::PoseStamped& start, const geometry_msgs::PoseStamped& goal,
+                       const std::vector<nav2dcell_t>& changedcellsV, std::vector<geometry_msgs::PoseStamped>& plan);
+
+  /**
+   * @brief Create a planner of the given type searching in env
+   * @return The planner, or NULL if the type is not supported
+   */
+  SBPLPlanner* createPlanner(const std::string& planner_type, EnvironmentNAVXYTHETALAT* env, bool forward_search);
+
+  /**
+   * @brief Read the planner configurations of the "Portfolio" planner type
+   */
+  void loadPortfolio(ros::NodeHandle& private_nh);
+
+  /**
+   * @brief Run all portfolio configurations in parallel and return the first solution found
+   */
+  bool makePortfolioPlan(const geometry_msgs::PoseStamped& start, const geometry_msgs::PoseStamped& goal,
+                         const std::vector<nav2dcell_t>& changedcellsV, bool plan_from_scratch,
+                         std::vector<geometry_msgs::PoseStamped>& plan);
+  void runPortfolioWorker(unsigned int index);
+
+  /**
+   * @brief Convert the planning window of the costmap into the mapdata layout of the sbpl environment
+   *
+   * The environment can be larger than the window, cells outside of it are lethal.
+   */
+  void convertCostmap(std::vector<unsigned char>& sbpl_costs) const;
+
+  /**
+   * @brief Remember the costmap values within the planning window for the next syncCostmap()
+   */
+  void takeCostmapSnapshot();
+
+  /**
+   * @brief Load a new planning window or a costmap that changed its size into the environments
+   *
+   * The window must fit into the environments.
+   */
+  void resizeEnvironments();
+
+  /**
+   * @brief Throw away all environments and planners and set them up again
+   */
+  void reinitialize();
+
+  /**
+   * @brief Move the planning window so that it covers start, goals and the margin around them
+   *
+   * The environments are reinitialized only if the window does not fit into them, or if they
+   * have been much larger than needed for window_shrink_count_ queries in a row.
+   */
+  void updateWindow(const geometry_msgs::PoseStamped& start, const std::vector<geometry_msgs::PoseStamped>& goals,
+                    double margin);
+
+  /**
+   * @return True if the planning window covers the whole costmap
+   */
+  bool windowCoversCostmap() const;
+
+  /**
+   * @brief Change the circumscribed cost threshold of the initialized environments
+   */
+  void updateCircumscribedCost(unsigned char circumscribed_cost);
+
+  /**
+   * @brief Stop the portfolio searches that are still running after makePlan returned and wait for them
+   */
+  void joinPortfolio();
+
+  /**
+   * @brief Delete the environments and planners of the portfolio and the batch workers, except for env_ and planner_
+   */
+  void deleteWorkers();
+
+  /**
+   * @brief Reinitialize or resize the environments if the costmap or footprint require it
+   */
+  void updateEnvironments();
+
+  /**
+   * @brief Bring env_ and planner_ up to date with the costmap
+   * @param changedcellsV Filled with the cells whose sbpl cost changed
+   * @param plan_from_scratch Set if so many cells changed that planner_ was told to plan from scratch
+   * @return False if sbpl failed to process the changes
+   */
+  bool syncCostmap(std::vector<nav2dcell_t>& changedcellsV, bool& plan_from_scratch);
+
+  /**
+   * @brief Pass the changes found by syncCostmap on to another environment
+   */
+  bool syncWorker(PlannerWorker& worker, const std::vector<nav2dcell_t>& changedcellsV, bool plan_from_scratch);
+
+  /**
+   * @brief Decide whether repairing the last search is expected to be slower than starting over
+   */
+  bool choosePlanFromScratch(const std::vector<nav2dcell_t>& changedcellsV, int changed_cells);
+
+  /**
+   * @brief Count changed cells, with the ones far from the last solution path weighted down
+   */
+  double weightChangedCells(const std::vector<nav2dcell_t>& changedcellsV) const;
+
+  /**
+   * @brief Learn from the replan makePlan just did
+   */
+  void updateReplanCostModel(bool from_scratch);
+
+  /**
+   * @brief Keep a sparse copy of sbpl_path_ in cells for weightChangedCells()
+   */
+  void rememberSolutionPath();
+
+  bool setStartAndGoal(EnvironmentNAVXYTHETALAT* env, SBPLPlanner* planner,
+                       const geometry_msgs::PoseStamped& start, const geometry_msgs::PoseStamped& goal);
+
+  /**
+   * @brief Plan to the goals of a batch that no other worker has taken yet
+   */
+  void runBatchWorker(PlannerWorker* worker, const geometry_msgs::PoseStamped& start,
+                      const std::vector<geometry_msgs::PoseStamped>& goals,
+                      double allocated_time, bool first_solution_only, bool stop_at_first_plan,
+                      std::vector<std::vector<geometry_msgs::PoseStamped> >* plans,
+                      std::vector<int>* costs);
+
+  bool makePlansService(sbpl_lattice_planner::MakePlans::Request& req, sbpl_lattice_planner::MakePlans::Response& resp);
+
+  void computeCostTranslationTable();
+  unsigned char costMapCostToSBPLCost(unsigned char newcost) const;
+  /**
+   * @brief Convert n consecutive costmap values into sbpl costs
+   */
+  void costMapCostsToSBPLCosts(const unsigned char* costs, unsigned char* sbpl_costs, unsigned int n) const;
+  /**
+   * @brief Publish the stats of a planning request
+   * @param phase_stats The phase timings and costmap changes, the other fields are filled in here
+   */
+  void publishStats(const sbpl_lattice_planner::SBPLLatticePlannerStats& phase_stats,
+                    SBPLPlanner* planner, double initial_epsilon, const std::string& configuration,
+                    int solution_cost, int solution_size, 
                     const geometry_msgs::PoseStamped& start, 
                     const geometry_msgs::PoseStamped& goal);
 
   unsigned char computeCircumscribedCost();
 
+  /**
+   * @brief Convert a solution of the sbpl environment into a plan in the costmap's global frame
+   * @return False if sbpl fails to reconstruct the path
+   */
+  bool extractPlan(EnvironmentNAVXYTHETALAT* env, std::vector<int>& solution_stateIDs,
+                   std::vector<EnvNAVXYTHETALAT3Dpt_t>& sbpl_path, const geometry_msgs::PoseStamped& start,
+                   std::vector<geometry_msgs::PoseStamped>& plan);
+
+  /**
+   * @brief Convert the sbpl poses [begin, end) into poses in the costmap's global frame
+   */
+  void convertPoses(const std::vector<EnvNAVXYTHETALAT3Dpt_t>& sbpl_path, unsigned int begin, unsigned int end,
+                    double z, geometry_msgs::PoseStamped* poses) const;
+  void publishPlan(const std::vector<geometry_msgs::PoseStamped>& plan);
+
+  /**
+   * @brief Background thread that keeps improving the last solution in async mode
+   */
+  void planningThread();
+
+  /**
+   * @brief Run the anytime search for one time slice and publish the plan if epsilon went down
+   */
+  void improveSolution();
+
+  /**
+   * @brief Convert, publish and cache the improved solution of the planning thread, needs the costmap lock
+   */
+  void takeImprovedSolution();
+
   bool initialized_;
 
   SBPLPlanner* planner_;
   EnvironmentNAVXYTHETALAT* env_;
   
-  std::string planner_type_; /**< sbpl method to use for planning.  choices are ARAPlanner and ADPlanner */
+  std::string planner_type_; /**< sbpl method to use for planning.  choices are ARAPlanner, ADPlanner and Portfolio */
 
   double allocated_time_; /**< amount of time allowed for search */
   double initial_epsilon_; /**< initial epsilon for beginning the anytime search */
@@ -82,21 +371,103 @@ private:
 
   bool forward_search_; /** whether to use forward or backward search */
   std::string primitive_filename_; /** where to find the motion primitives for the current robot */
+  bool primitive_cache_; /** whether to keep the precomputed primitive tables in primitive_cache_dir_ */
+  std::string primitive_cache_dir_;
   int force_scratch_limit_; /** the number of cells that have to be changed in the costmap to force the planner to plan from scratch even if its an incremental planner */
+  bool adaptive_force_scratch_; /** whether to learn when to plan from scratch instead of using force_scratch_limit_ */
+  double adaptive_path_distance_; /** changed cells closer than this to the last solution path count fully */
+  double adaptive_far_weight_; /** weight of changed cells further away from the last solution path */
+  double adaptive_decay_; /** factor by which older replans are discounted */
+  bool async_planning_; /** whether makePlan returns the first solution and leaves improving it to a background thread */
+  double async_time_slice_; /** how long the background search runs before checking whether makePlan wants the planner back */
+  bool planning_window_; /** whether to plan in a window around start and goal instead of the whole costmap */
+  double window_margin_; /** how far the planning window reaches beyond start and goal */
+  double window_growth_; /** factor on the needed window size when the environments are (re)allocated */
+  int window_shrink_count_; /** consecutive oversized queries after which the environments are shrunk */
+  std::string coarse_primitive_filename_; /** motion primitives of the coarse lattice, hierarchical planning is off without them */
+  int coarse_factor_; /** how many costmap cells make up a cell of the coarse lattice, in each direction */
+  double fine_planning_distance_; /** how far along the coarse plan the fine lattice refines it */
+  bool reuse_plan_; /** whether makePlan returns the rest of the last plan if no costmap change is in its way */
+  double reuse_distance_; /** how far the robot may be off the last plan for it to be reused */
+  double nominalvel_mpersecs_;
+  double timetoturn45degsinplace_secs_;
 
   unsigned char lethal_obstacle_;
   unsigned char inscribed_inflated_obstacle_;
   unsigned char circumscribed_cost_;
   unsigned char sbpl_cost_multiplier_;
+  unsigned char cost_translation_table_[256]; /**< sbpl cost for every costmap value, see computeCostTranslationTable() */
 
   std::string name_;
   costmap_2d::Costmap2DROS* costmap_ros_; /**< manages the cost map for us */
   std::vector<geometry_msgs::Point> footprint_;
-  unsigned int current_env_width_;
+  unsigned int current_env_width_; /**< size of the sbpl environments, at least the size of the planning window */
   unsigned int current_env_height_;
+  unsigned int current_map_width_; /**< size of the costmap at the last sync */
+  unsigned int current_map_height_;
+  unsigned int window_x_, window_y_; /**< first costmap cell of the planning window, which sbpl cell (0, 0) stands for */
+  unsigned int window_width_, window_height_; /**< size of the planning window, the whole costmap unless planning_window_ is set */
+  double window_scale_; /**< factor on window_margin_, doubled whenever no plan is found within the window */
+  unsigned int window_oversized_count_; /**< consecutive queries for which the environments were more than 4 times the needed size */
+  geometry_msgs::PoseStamped window_goal_; /**< goal that window_scale_ was grown for */
+  std::vector<unsigned char> costmap_snapshot_; /**< costmap values within the planning window as of the last sync with the sbpl environment */
+  double env_origin_x_, env_origin_y_; /**< origin of the planning window at the last sync, sbpl coordinates are relative to it */
 
   ros::Publisher plan_pub_;
   ros::Publisher stats_publisher_;
+  sbpl_lattice_planner::SBPLLatticePlannerStats phase_stats_; /**< phase timings and costmap changes of the current planning request */
+
+  ReplanCostModel repair_cost_model_; /**< seconds to the first solution when the last search is repaired */
+  ReplanCostModel scratch_cost_model_; /**< seconds to the first solution when searching from scratch */
+  std::vector<nav2dcell_t> solution_path_cells_;
+  geometry_msgs::PoseStamped last_goal_;
+  ros::ServiceServer make_plans_srv_;
+
+  boost::thread* planning_thread_;
+  boost::mutex planner_mutex_; /**< guards env_ and planner_ against the planning thread */
+  boost::condition_variable planner_cond_;
+  std::atomic<bool> preempt_requested_; /**< set by makePlan while it waits for planner_mutex_ */
+  bool improve_solution_;
+  bool shutdown_;
+  ros::WallTime improvement_deadline_;
+  geometry_msgs::PoseStamped async_start_, async_goal_;
+  std::vector<geometry_msgs::PoseStamped> async_plan_;
+  bool improved_solution_pending_; /**< solution_stateIDs_ holds an improved solution that was not converted yet */
+  int improved_solution_cost_;
+
+  std::vector<int> solution_stateIDs_; /**< reused buffers for the solutions of planner_, guarded by planner_mutex_ */
+  std::vector<EnvNAVXYTHETALAT3Dpt_t> sbpl_path_;
+
+  std::vector<PlannerWorker> portfolio_; /**< planner configurations of the "Portfolio" planner type, the first one shares env_ and planner_ */
+  boost::mutex portfolio_mutex_; /**< guards the results of the portfolio searches */
+  boost::condition_variable portfolio_cond_;
+  int portfolio_winner_; /**< index of the configuration with the cheapest solution so far, -1 if there is none */
+  unsigned int portfolio_running_;
+  bool portfolio_returned_; /**< whether makePlan already returned a solution of the current portfolio run */
+  std::atomic<bool> portfolio_stop_; /**< set by joinPortfolio, the searches check it between two time slices */
+  double portfolio_time_slice_;
+  geometry_msgs::PoseStamped portfolio_start_, portfolio_goal_;
+
+  std::vector<PlannerWorker> batch_workers_; /**< environments that plan batched queries in parallel with env_ */
+  std::atomic<unsigned int> batch_next_goal_;
+  std::atomic<unsigned int> batch_first_plan_; /**< lowest goal index of the current batch that has a plan */
+
+  EnvironmentNAVXYTHETALAT* coarse_env_; /**< coarse lattice of the hierarchical mode, NULL if it is off */
+  SBPLPlanner* coarse_planner_;
+  unsigned int coarse_env_width_, coarse_env_height_;
+  std::vector<int> coarse_stateIDs_;
+  std::vector<EnvNAVXYTHETALAT3Dpt_t> coarse_path_; /**< last coarse solution */
+  unsigned int coarse_split_; /**< first pose of coarse_path_ the fine plan does not cover, the size of coarse_path_ if it covers all */
+
+  std::vector<geometry_msgs::PoseStamped> cached_plan_; /**< last plan for reuse_plan_, empty if there is none */
+  geometry_msgs::PoseStamped cached_goal_;
+  int cached_solution_cost_;
+  unsigned int cached_index_; /**< pose of cached_plan_ the robot was closest to at the last reuse */
+  unsigned int cached_fine_size_; /**< number of poses of cached_plan_ that come from the fine lattice */
+  double cached_origin_x_, cached_origin_y_; /**< env_origin_x_ and env_origin_y_ the swept blocks refer to */
+  unsigned int cached_block_size_; /**< edge length in cells of the blocks of cached_last_pose_ */
+  unsigned int cached_blocks_x_, cached_blocks_y_, cached_blocks_width_, cached_blocks_height_;
+  std::vector<int> cached_last_pose_; /**< per block around the cached plan, the last pose whose footprint may reach into it, -1 if none */
 };
 };
 
@@ -0,0 +1,189 @@
+/*********************************************************************
+*
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*
+*********************************************************************/
+
+// Compares the two ways makePlan has synced the costmap into the sbpl
+// environment: the old one walks the map column by column through
+// Costmap2D::getCost and compares against the environment's grid, the
+// current one walks getCharMap() and a snapshot of it linearly in 64-cell
+// blocks and skips unchanged blocks with memcmp. Both run on the same square
+// maps, with a share of the cells changed before every sync, and must find
+// the same changed cells. The environment grid is kept column-major like
+// sbpl's Grid2D, so both variants write the same cells in the same layout.
+
+#include <ros/ros.h>
+#include <costmap_2d/costmap_2d.h>
+#include <costmap_2d/cost_values.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+// nearest rank percentile, 0 for an empty sample
+double percentile(std::vector<double> values, double p){
+  if(values.empty())
+    return 0.0;
+  std::sort(values.begin(), values.end());
+  size_t rank = std::ceil(p / 100.0 * values.size());
+  return values[std::min(std::max<size_t>(rank, 1), values.size()) - 1];
+}
+
+// same scaling as the planner's default translation table, without the
+// inflation-dependent thresholds, which only change what the cells map to
+unsigned char toSBPLCost(unsigned char cost){
+  if(cost == costmap_2d::LETHAL_OBSTACLE || cost == costmap_2d::NO_INFORMATION)
+    return 20;
+  if(cost == costmap_2d::INSCRIBED_INFLATED_OBSTACLE)
+    return 19;
+  return cost * 18 / 252;
+}
+
+// the makePlan diff before the block sync, see the history of sbpl_lattice_planner.cpp
+unsigned int columnMajorSync(const costmap_2d::Costmap2D& costmap, std::vector<unsigned char>& env_grid){
+  const unsigned int size_y = costmap.getSizeInCellsY();
+  unsigned int changed = 0;
+  for(unsigned int ix = 0; ix < costmap.getSizeInCellsX(); ix++){
+    for(unsigned int iy = 0; iy < costmap.getSizeInCellsY(); iy++){
+      unsigned char oldCost = env_grid[ix * size_y + iy];
+      unsigned char newCost = toSBPLCost(costmap.getCost(ix, iy));
+      if(oldCost == newCost) continue;
+      env_grid[ix * size_y + iy] = newCost;
+      changed++;
+    }
+  }
+  return changed;
+}
+
+// the current makePlan diff
+unsigned int blockSync(const costmap_2d::Costmap2D& costmap, std::vector<unsigned char>& snapshot,
+                       std::vector<unsigned char>& env_grid){
+  const unsigned int size_x = costmap.getSizeInCellsX();
+  const unsigned int size_y = costmap.getSizeInCellsY();
+  const unsigned int num_cells = size_x * size_y;
+  const unsigned int block_size = 64;
+  const unsigned char* charmap = costmap.getCharMap();
+  unsigned int changed = 0;
+  for(unsigned int block = 0; block < num_cells; block += block_size){
+    const unsigned int block_end = std::min(block + block_size, num_cells);
+    if(memcmp(charmap + block, &snapshot[block], block_end - block) == 0) continue;
+
+    for(unsigned int index = block; index < block_end; index++){
+      if(charmap[index] == snapshot[index]) continue;
+      unsigned char oldCost = toSBPLCost(snapshot[index]);
+      unsigned char newCost = toSBPLCost(charmap[index]);
+      snapshot[index] = charmap[index];
+      if(oldCost == newCost) continue;
+      env_grid[(index % size_x) * size_y + index / size_x] = newCost;
+      changed++;
+    }
+  }
+  return changed;
+}
+
+}
+
+int main(int argc, char** argv){
+  ros::init(argc, argv, "costmap_sync_benchmark");
+  ros::NodeHandle private_nh("~");
+
+  std::vector<int> sizes;
+  int iterations;
+  double changed_share;
+  private_nh.param("sizes", sizes, std::vector<int>{2000, 4000});
+  private_nh.param("iterations", iterations, 20);
+  private_nh.param("changed_share", changed_share, 0.01);
+
+  for(unsigned int s = 0; s < sizes.size() && ros::ok(); ++s){
+    const unsigned int size = std::max(sizes[s], 1);
+    costmap_2d::Costmap2D costmap(size, size, 0.05, 0.0, 0.0, costmap_2d::FREE_SPACE);
+
+    // walls every 50 cells give the maps some structure to start from
+    for(unsigned int iy = 0; iy < size; ++iy){
+      for(unsigned int ix = 0; ix < size; ++ix){
+        if(ix % 50 == 0 || iy % 50 == 0)
+          costmap.setCost(ix, iy, costmap_2d::LETHAL_OBSTACLE);
+      }
+    }
+
+    std::vector<unsigned char> snapshot(costmap.getCharMap(), costmap.getCharMap() + size * size);
+    std::vector<unsigned char> old_grid(size * size), new_grid(size * size);
+    for(unsigned int ix = 0; ix < size; ++ix){
+      for(unsigned int iy = 0; iy < size; ++iy)
+        old_grid[ix * size + iy] = new_grid[ix * size + iy] = toSBPLCost(costmap.getCost(ix, iy));
+    }
+
+    // the changes are clustered in short runs along the rows, like obstacles
+    // showing up in front of the robot, and differ from one sync to the next
+    const unsigned int run = 8;
+    const unsigned int runs = std::max(changed_share * size * size / run, 1.0);
+    unsigned int seed = 12345;
+    std::vector<double> old_latency, new_latency;
+    for(int i = 0; i < iterations && ros::ok(); ++i){
+      for(unsigned int r = 0; r < runs; ++r){
+        seed = seed * 1103515245 + 12345;
+        unsigned int index = seed % (size * size);
+        unsigned char cost = (i + r) % 2 ? costmap_2d::LETHAL_OBSTACLE : 100;
+        for(unsigned int k = index; k < std::min(index + run, size * size); ++k)
+          costmap.getCharMap()[k] = cost;
+      }
+
+      ros::WallTime start = ros::WallTime::now();
+      unsigned int old_changed = columnMajorSync(costmap, old_grid);
+      old_latency.push_back((ros::WallTime::now() - start).toSec() * 1e3);
+
+      start = ros::WallTime::now();
+      unsigned int new_changed = blockSync(costmap, snapshot, new_grid);
+      new_latency.push_back((ros::WallTime::now() - start).toSec() * 1e3);
+
+      if(old_changed != new_changed || old_grid != new_grid){
+        ROS_ERROR("The syncs disagree on a %ux%u map: %u and %u changed cells", size, size, old_changed, new_changed);
+        return 1;
+      }
+    }
+
+    double old_p50 = percentile(old_latency, 50), new_p50 = percentile(new_latency, 50);
+    printf("%ux%u map, %d syncs with %.1f%% of the cells changed\n", size, size, (int)old_latency.size(),
+           100.0 * changed_share);
+    printf("  column-major getCost sync [ms]: p50 %.2f p90 %.2f max %.2f\n",
+           old_p50, percentile(old_latency, 90), percentile(old_latency, 100));
+    printf("  char map block sync [ms]:       p50 %.2f p90 %.2f max %.2f\n",
+           new_p50, percentile(new_latency, 90), percentile(new_latency, 100));
+    printf("  speedup at p50: %.1fx\n", new_p50 > 0.0 ? old_p50 / new_p50 : 0.0);
+  }
+  return 0;
+}
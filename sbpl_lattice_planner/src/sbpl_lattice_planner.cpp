@@ -42,6 +42,25 @@
 
 #include <costmap_2d/inflation_layer.h>
 #include <tf2/LinearMath/Quaternion.h>
+#include <xmlrpcpp/XmlRpcException.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <type_traits>
 
 using namespace std;
 using namespace ros;
@@ -84,15 +103,361 @@ class LatticeSCQ : public StateChangeQuery{
     mutable std::vector<int> succsOfChangedCells_;
 };
 
+// Measures the wall time and the cpu time of the calling thread spent in one
+// phase of a planning request.
+class PhaseTimer{
+  public:
+    PhaseTimer() : wall_start_(ros::WallTime::now()), cpu_start_(threadCpuTime()){
+    }
+
+    void stop(double& wall_time, double& cpu_time) const{
+      wall_time = (ros::WallTime::now() - wall_start_).toSec();
+      cpu_time = threadCpuTime() - cpu_start_;
+    }
+
+  private:
+    static double threadCpuTime(){
+      timespec t;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+      return t.tv_sec + 1e-9 * t.tv_nsec;
+    }
+
+    ros::WallTime wall_start_;
+    double cpu_start_;
+};
+
+// 64 bit FNV-1a, the key of the primitive cache files
+class Fnv1aHash{
+  public:
+    Fnv1aHash() : hash_(14695981039346656037ULL){
+    }
+
+    void add(const void* data, size_t size){
+      const unsigned char* bytes = static_cast<const unsigned char*>(data);
+      for(size_t i = 0; i < size; ++i){
+        hash_ ^= bytes[i];
+        hash_ *= 1099511628211ULL;
+      }
+    }
+
+    template<class T>
+    void add(const T& value){
+      add(&value, sizeof(value));
+    }
+
+    uint64_t value() const{
+      return hash_;
+    }
+
+  private:
+    uint64_t hash_;
+};
+
+// The primitive cache is a flat sequence of values and length-prefixed
+// arrays in the native layout, written in one go and read straight out of a
+// memory mapping of the file.
+class CacheWriter{
+  public:
+    template<class T>
+    void put(const T& value){
+      static_assert(std::is_trivially_copyable<T>::value, "only plain values can be cached");
+      const char* bytes = reinterpret_cast<const char*>(&value);
+      data_.insert(data_.end(), bytes, bytes + sizeof(T));
+    }
+
+    template<class T>
+    void putVector(const std::vector<T>& values){
+      static_assert(std::is_trivially_copyable<T>::value, "only plain values can be cached");
+      put<uint32_t>(values.size());
+      const char* bytes = reinterpret_cast<const char*>(values.data());
+      data_.insert(data_.end(), bytes, bytes + values.size() * sizeof(T));
+    }
+
+    // write to a temporary file first, so that processes starting at the
+    // same time never map a half written cache
+    bool save(const std::string& path) const{
+      std::ostringstream tmp_path;
+      tmp_path << path << ".tmp" << getpid();
+      FILE* file = fopen(tmp_path.str().c_str(), "wb");
+      if(!file)
+        return false;
+      bool ok = fwrite(data_.data(), 1, data_.size(), file) == data_.size();
+      ok = fclose(file) == 0 && ok;
+      if(!ok || rename(tmp_path.str().c_str(), path.c_str()) != 0){
+        unlink(tmp_path.str().c_str());
+        return false;
+      }
+      return true;
+    }
+
+  private:
+    std::vector<char> data_;
+};
+
+class CacheReader{
+  public:
+    CacheReader(const char* begin, size_t size) : next_(begin), end_(begin + size){
+    }
+
+    template<class T>
+    bool get(T& value){
+      if(end_ - next_ < (ptrdiff_t)sizeof(T))
+        return false;
+      memcpy(&value, next_, sizeof(T));
+      next_ += sizeof(T);
+      return true;
+    }
+
+    template<class T>
+    bool getVector(std::vector<T>& values){
+      uint32_t size;
+      if(!get(size) || (size_t)(end_ - next_) / sizeof(T) < size)
+        return false;
+      values.resize(size);
+      memcpy(values.data(), next_, size * sizeof(T));
+      next_ += size * sizeof(T);
+      return true;
+    }
+
+    bool atEnd() const{
+      return next_ == end_;
+    }
+
+  private:
+    const char* next_;
+    const char* end_;
+};
+
+// bump this whenever the layout of the cache or of the sbpl tables it holds changes
+const uint32_t kPrimitiveCacheVersion = 1;
+const char kPrimitiveCacheMagic[8] = {'S', 'B', 'P', 'L', 'M', 'P', 'C', '\0'};
+
+// The actions of an environment in a form that can be cached. sbpl allocates
+// one row of actionwidth actions per start heading.
+struct CachedAction{
+  int32_t aind, starttheta, dX, dY, endtheta;
+  uint32_t cost;
+};
+
+// sbpl only accepts environment parameters before InitializeEnv. The
+// circumscribed threshold is only read when actions are costed, though, so it
+// can be changed on an initialized environment as long as the planner
+// searches from scratch afterwards.
+//
+// InitializeEnv spends most of its time parsing the motion primitives and
+// precomputing the cells every action sweeps with the footprint. These tables
+// only depend on the primitive file, the footprint, the resolution and the
+// velocities the action costs are computed from, so they are saved after a
+// regular InitializeEnv and loaded in place of that work later on.
+class LatticeEnvironment : public EnvironmentNAVXYTHETALAT{
+  public:
+    void setPossiblyCircumscribedThresh(int thresh){
+      EnvNAVXYTHETALATCfg.cost_possibly_circumscribed_thresh = thresh;
+    }
+
+    bool savePrimitiveTables(const std::string& path, uint64_t key) const;
+
+    /**
+     * @brief Do what InitializeEnv does with the primitive tables of a cache file instead of the primitive file
+     * @return False if the file does not exist or does not match key, the environment is unchanged then
+     */
+    bool initializeFromPrimitiveTables(const std::string& path, uint64_t key, int width, int height,
+                                       const unsigned char* mapdata, const std::vector<sbpl_2Dpt_t>& perimeterptsV,
+                                       double cellsize_m, double nominalvel_mpersecs,
+                                       double timetoturn45degsinplace_secs, unsigned char obsthresh);
+};
+
+bool LatticeEnvironment::savePrimitiveTables(const std::string& path, uint64_t key) const{
+  const EnvNAVXYTHETALATConfig_t& cfg = EnvNAVXYTHETALATCfg;
+  CacheWriter writer;
+  writer.put(kPrimitiveCacheMagic);
+  writer.put(kPrimitiveCacheVersion);
+  writer.put(key);
+  writer.put<int32_t>(cfg.NumThetaDirs);
+  writer.put<int32_t>(cfg.actionwidth);
+  writer.put<uint8_t>(bUseNonUniformAngles);
+  writer.putVector(cfg.ThetaDirs);
+  for(int i = 0; i < NAVXYTHETALAT_DXYWIDTH; ++i){
+    writer.put<int32_t>(cfg.dXY[i][0]);
+    writer.put<int32_t>(cfg.dXY[i][1]);
+  }
+
+  for(int tind = 0; tind < cfg.NumThetaDirs; ++tind){
+    for(int aind = 0; aind < cfg.actionwidth; ++aind){
+      const EnvNAVXYTHETALATAction_t& action = cfg.ActionsV[tind][aind];
+      CachedAction cached;
+      cached.aind = action.aind;
+      cached.starttheta = action.starttheta;
+      cached.dX = action.dX;
+      cached.dY = action.dY;
+      cached.endtheta = action.endtheta;
+      cached.cost = action.cost;
+      writer.put(cached);
+      writer.putVector(action.intersectingcellsV);
+      writer.putVector(action.intermptV);
+      writer.putVector(action.interm3DcellsV);
+    }
+  }
+
+  // the predecessor lists point into the action rows, they are stored as
+  // (start heading, action) pairs
+  for(int tind = 0; tind < cfg.NumThetaDirs; ++tind){
+    const std::vector<EnvNAVXYTHETALATAction_t*>& preds = cfg.PredActionsV[tind];
+    std::vector<int32_t> pred_indices;
+    pred_indices.reserve(2 * preds.size());
+    for(size_t i = 0; i < preds.size(); ++i){
+      int row = 0;
+      while(row < cfg.NumThetaDirs &&
+            (preds[i] < cfg.ActionsV[row] || preds[i] >= cfg.ActionsV[row] + cfg.actionwidth))
+        ++row;
+      if(row == cfg.NumThetaDirs)
+        return false;
+      pred_indices.push_back(row);
+      pred_indices.push_back(preds[i] - cfg.ActionsV[row]);
+    }
+    writer.putVector(pred_indices);
+  }
+
+  writer.putVector(affectedsuccstatesV);
+  writer.putVector(affectedpredstatesV);
+  return writer.save(path);
+}
+
+bool LatticeEnvironment::initializeFromPrimitiveTables(const std::string& path, uint64_t key, int width, int height,
+                                                       const unsigned char* mapdata,
+                                                       const std::vector<sbpl_2Dpt_t>& perimeterptsV,
+                                                       double cellsize_m, double nominalvel_mpersecs,
+                                                       double timetoturn45degsinplace_secs, unsigned char obsthresh){
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+  struct stat file_stat;
+  void* mapping = MAP_FAILED;
+  if(fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED)
+    return false;
+
+  // everything is read before the environment is touched, so that a corrupt
+  // or stale file leaves it ready for a regular InitializeEnv
+  CacheReader reader(static_cast<const char*>(mapping), file_stat.st_size);
+  char magic[sizeof(kPrimitiveCacheMagic)];
+  uint32_t version;
+  uint64_t file_key;
+  int32_t num_theta_dirs, action_width;
+  uint8_t non_uniform_angles;
+  std::vector<double> theta_dirs;
+  int32_t dxy[NAVXYTHETALAT_DXYWIDTH][2];
+  bool ok = reader.get(magic) && memcmp(magic, kPrimitiveCacheMagic, sizeof(magic)) == 0 &&
+            reader.get(version) && version == kPrimitiveCacheVersion &&
+            reader.get(file_key) && file_key == key &&
+            reader.get(num_theta_dirs) && num_theta_dirs > 0 &&
+            reader.get(action_width) && action_width > 0 &&
+            reader.get(non_uniform_angles) && reader.getVector(theta_dirs);
+  for(int i = 0; ok && i < NAVXYTHETALAT_DXYWIDTH; ++i)
+    ok = reader.get(dxy[i][0]) && reader.get(dxy[i][1]);
+
+  std::vector<EnvNAVXYTHETALATAction_t> actions(ok ? num_theta_dirs * action_width : 0);
+  for(size_t i = 0; ok && i < actions.size(); ++i){
+    CachedAction cached;
+    ok = reader.get(cached) &&
+         reader.getVector(actions[i].intersectingcellsV) &&
+         reader.getVector(actions[i].intermptV) &&
+         reader.getVector(actions[i].interm3DcellsV);
+    actions[i].aind = cached.aind;
+    actions[i].starttheta = cached.starttheta;
+    actions[i].dX = cached.dX;
+    actions[i].dY = cached.dY;
+    actions[i].endtheta = cached.endtheta;
+    actions[i].cost = cached.cost;
+  }
+  std::vector<std::vector<int32_t> > pred_indices(ok ? num_theta_dirs : 0);
+  for(size_t tind = 0; ok && tind < pred_indices.size(); ++tind){
+    ok = reader.getVector(pred_indices[tind]) && pred_indices[tind].size() % 2 == 0;
+    for(size_t i = 0; ok && i < pred_indices[tind].size(); i += 2)
+      ok = pred_indices[tind][i] >= 0 && pred_indices[tind][i] < num_theta_dirs &&
+           pred_indices[tind][i + 1] >= 0 && pred_indices[tind][i + 1] < action_width;
+  }
+  std::vector<sbpl_xy_theta_cell_t> affected_succs, affected_preds;
+  ok = ok && reader.getVector(affected_succs) && reader.getVector(affected_preds) && reader.atEnd();
+  munmap(mapping, file_stat.st_size);
+  if(!ok)
+    return false;
+
+  // the rest follows InitializeEnv and InitGeneral, for a start and goal at the origin
+  EnvNAVXYTHETALATCfg.obsthresh = obsthresh;
+  EnvNAVXYTHETALATCfg.cellsize_m = cellsize_m;
+  EnvNAVXYTHETALATCfg.StartTheta_rad = 0.0;
+  EnvNAVXYTHETALATCfg.EndTheta_rad = 0.0;
+  EnvNAVXYTHETALATCfg.NumThetaDirs = num_theta_dirs;
+  EnvNAVXYTHETALATCfg.ThetaDirs = theta_dirs;
+  bUseNonUniformAngles = non_uniform_angles;
+  EnvNAVXYTHETALATCfg.StartTheta = 0;
+  EnvNAVXYTHETALATCfg.EndTheta = 0;
+  SetConfiguration(width, height, mapdata, 0, 0, 0, 0, 0, 0, cellsize_m, nominalvel_mpersecs,
+                   timetoturn45degsinplace_secs, perimeterptsV);
+
+  for(int i = 0; i < NAVXYTHETALAT_DXYWIDTH; ++i){
+    EnvNAVXYTHETALATCfg.dXY[i][0] = dxy[i][0];
+    EnvNAVXYTHETALATCfg.dXY[i][1] = dxy[i][1];
+  }
+  // allocated like sbpl does, which frees them in its destructor
+  EnvNAVXYTHETALATCfg.actionwidth = action_width;
+  EnvNAVXYTHETALATCfg.ActionsV = new EnvNAVXYTHETALATAction_t*[num_theta_dirs];
+  EnvNAVXYTHETALATCfg.PredActionsV = new std::vector<EnvNAVXYTHETALATAction_t*>[num_theta_dirs];
+  for(int tind = 0; tind < num_theta_dirs; ++tind){
+    EnvNAVXYTHETALATCfg.ActionsV[tind] = new EnvNAVXYTHETALATAction_t[action_width];
+    for(int aind = 0; aind < action_width; ++aind)
+      EnvNAVXYTHETALATCfg.ActionsV[tind][aind] = actions[tind * action_width + aind];
+  }
+  for(int tind = 0; tind < num_theta_dirs; ++tind){
+    for(size_t i = 0; i < pred_indices[tind].size(); i += 2)
+      EnvNAVXYTHETALATCfg.PredActionsV[tind].push_back(
+          &EnvNAVXYTHETALATCfg.ActionsV[pred_indices[tind][i]][pred_indices[tind][i + 1]]);
+  }
+  affectedsuccstatesV.swap(affected_succs);
+  affectedpredstatesV.swap(affected_preds);
+
+  InitializeEnvironment();
+  ComputeHeuristicValues();
+  return true;
+}
+
 SBPLLatticePlanner::SBPLLatticePlanner()
-  : initialized_(false), costmap_ros_(NULL){
+  : initialized_(false), costmap_ros_(NULL), current_env_width_(0), current_env_height_(0),
+    window_x_(0), window_y_(0), window_width_(0), window_height_(0), window_scale_(1.0), window_oversized_count_(0),
+    planning_thread_(NULL), preempt_requested_(false),
+    improve_solution_(false), shutdown_(false), improved_solution_pending_(false),
+    improved_solution_cost_(0), portfolio_winner_(-1), portfolio_running_(0),
+    portfolio_returned_(false), portfolio_stop_(false), coarse_env_(NULL), coarse_planner_(NULL), coarse_env_width_(0), coarse_env_height_(0),
+    coarse_split_(0), cached_solution_cost_(0), cached_index_(0), cached_fine_size_(0){
 }
 
 SBPLLatticePlanner::SBPLLatticePlanner(std::string name, costmap_2d::Costmap2DROS* costmap_ros) 
-  : initialized_(false), costmap_ros_(NULL){
+  : initialized_(false), costmap_ros_(NULL), current_env_width_(0), current_env_height_(0),
+    window_x_(0), window_y_(0), window_width_(0), window_height_(0), window_scale_(1.0), window_oversized_count_(0),
+    planning_thread_(NULL), preempt_requested_(false),
+    improve_solution_(false), shutdown_(false), improved_solution_pending_(false),
+    improved_solution_cost_(0), portfolio_winner_(-1), portfolio_running_(0),
+    portfolio_returned_(false), portfolio_stop_(false), coarse_env_(NULL), coarse_planner_(NULL), coarse_env_width_(0), coarse_env_height_(0),
+    coarse_split_(0), cached_solution_cost_(0), cached_index_(0), cached_fine_size_(0){
   initialize(name, costmap_ros);
 }
 
+SBPLLatticePlanner::~SBPLLatticePlanner(){
+  if(planning_thread_){
+    {
+      boost::mutex::scoped_lock lock(planner_mutex_);
+      shutdown_ = true;
+    }
+    planner_cond_.notify_all();
+    planning_thread_->join();
+    delete planning_thread_;
+  }
+  joinPortfolio();
+}
+
     
 void SBPLLatticePlanner::initialize(std::string name, costmap_2d::Costmap2DROS* costmap_ros){
   if(!initialized_){
@@ -106,11 +471,37 @@ void SBPLLatticePlanner::initialize(std::string name, costmap_2d::Costmap2DROS*
     private_nh.param("environment_type", environment_type_, string("XYThetaLattice"));
     private_nh.param("forward_search", forward_search_, bool(false));
     private_nh.param("primitive_filename",primitive_filename_,string(""));
+    private_nh.param("primitive_cache", primitive_cache_, false);
+    const char* ros_home = getenv("ROS_HOME");
+    const char* home = getenv("HOME");
+    private_nh.param("primitive_cache_dir", primitive_cache_dir_,
+                     ros_home ? string(ros_home) : string(home ? home : ".") + "/.ros");
     private_nh.param("force_scratch_limit",force_scratch_limit_,500);
+    private_nh.param("adaptive_force_scratch", adaptive_force_scratch_, false);
+    private_nh.param("adaptive_path_distance", adaptive_path_distance_, 1.0);
+    private_nh.param("adaptive_far_weight", adaptive_far_weight_, 1.0);
+    private_nh.param("adaptive_decay", adaptive_decay_, 0.9);
+    private_nh.param("async_planning", async_planning_, false);
+    private_nh.param("async_time_slice", async_time_slice_, 0.1);
+    private_nh.param("portfolio_time_slice", portfolio_time_slice_, 0.1);
+    private_nh.param("planning_window", planning_window_, false);
+    private_nh.param("window_margin", window_margin_, 5.0);
+    private_nh.param("window_growth", window_growth_, 1.5);
+    private_nh.param("window_shrink_count", window_shrink_count_, 5);
+    if(window_growth_ < 1.0 || window_growth_ > 2.0){
+      ROS_WARN("window_growth must be within [1, 2], using 1.5 instead of %.2f", window_growth_);
+      window_growth_ = 1.5;
+    }
+    private_nh.param("coarse_primitive_filename", coarse_primitive_filename_, string(""));
+    private_nh.param("coarse_factor", coarse_factor_, 4);
+    private_nh.param("fine_planning_distance", fine_planning_distance_, 5.0);
+    private_nh.param("reuse_plan", reuse_plan_, false);
+    private_nh.param("reuse_distance", reuse_distance_, 0.2);
+    int batch_workers;
+    private_nh.param("batch_workers", batch_workers, 1);
 
-    double nominalvel_mpersecs, timetoturn45degsinplace_secs;
-    private_nh.param("nominalvel_mpersecs", nominalvel_mpersecs, 0.4);
-    private_nh.param("timetoturn45degsinplace_secs", timetoturn45degsinplace_secs, 0.6);
+    private_nh.param("nominalvel_mpersecs", nominalvel_mpersecs_, 0.4);
+    private_nh.param("timetoturn45degsinplace_secs", timetoturn45degsinplace_secs_, 0.6);
 
     int lethal_obstacle;
     private_nh.param("lethal_obstacle",lethal_obstacle,20);
@@ -118,6 +509,7 @@ void SBPLLatticePlanner::initialize(std::string name, costmap_2d::Costmap2DROS*
     inscribed_inflated_obstacle_ = lethal_obstacle_-1;
     sbpl_cost_multiplier_ = (unsigned char) (costmap_2d::INSCRIBED_INFLATED_OBSTACLE/inscribed_inflated_obstacle_ + 1);
     ROS_DEBUG("SBPL: lethal: %uz, inscribed inflated: %uz, multiplier: %uz",lethal_obstacle,inscribed_inflated_obstacle_,sbpl_cost_multiplier_);
+    computeCostTranslationTable();
 
     name_ = name;
     costmap_ros_ = costmap_ros;
@@ -126,7 +518,6 @@ void SBPLLatticePlanner::initialize(std::string name, costmap_2d::Costmap2DROS*
 
     if ("XYThetaLattice" == environment_type_){
       ROS_DEBUG("Using a 3D costmap for theta lattice\n");
-      env_ = new EnvironmentNAVXYTHETALAT();
     }
     else{
       ROS_ERROR("XYThetaLattice is currently the only supported environment!\n");
@@ -146,102 +537,596 @@ void SBPLLatticePlanner::initialize(std::string name, costmap_2d::Costmap2DROS*
       ROS_WARN("SBPL performance will suffer.");
       ROS_WARN("Please decrease the costmap's cost_scaling_factor.");
     }
-    if(!env_->SetEnvParameter("cost_inscribed_thresh",costMapCostToSBPLCost(costmap_2d::INSCRIBED_INFLATED_OBSTACLE))){
-      ROS_ERROR("Failed to set cost_inscribed_thresh parameter");
-      exit(1);
-    }
-    if(!env_->SetEnvParameter("cost_possibly_circumscribed_thresh", circumscribed_cost_)){
-      ROS_ERROR("Failed to set cost_possibly_circumscribed_thresh parameter");
-      exit(1);
-    }
-    int obst_cost_thresh = costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE);
-    vector<sbpl_2Dpt_t> perimeterptsV;
-    perimeterptsV.reserve(footprint_.size());
-    for (size_t ii(0); ii < footprint_.size(); ++ii) {
-      sbpl_2Dpt_t pt;
-      pt.x = footprint_[ii].x;
-      pt.y = footprint_[ii].y;
-      perimeterptsV.push_back(pt);
-    }
 
-    bool ret;
-    try{
-      ret = env_->InitializeEnv(costmap_ros_->getCostmap()->getSizeInCellsX(), // width
-                                costmap_ros_->getCostmap()->getSizeInCellsY(), // height
-                                0, // mapdata
-                                0, 0, 0, // start (x, y, theta, t)
-                                0, 0, 0, // goal (x, y, theta)
-                                0, 0, 0, //goal tolerance
-                                perimeterptsV, costmap_ros_->getCostmap()->getResolution(), nominalvel_mpersecs,
-                                timetoturn45degsinplace_secs, obst_cost_thresh,
-                                primitive_filename_.c_str());
-      current_env_width_ = costmap_ros_->getCostmap()->getSizeInCellsX();
-      current_env_height_ = costmap_ros_->getCostmap()->getSizeInCellsY();
+    const unsigned int size_x = costmap_ros_->getCostmap()->getSizeInCellsX();
+    const unsigned int size_y = costmap_ros_->getCostmap()->getSizeInCellsY();
+    if(planning_window_){
+      // updateWindow picks window and environment size for every query; until
+      // the first one comes in, cover one margin around the costmap's center
+      if(current_env_width_ == 0 || current_env_height_ == 0 ||
+         window_x_ + window_width_ > size_x || window_y_ + window_height_ > size_y){
+        unsigned int margin = window_margin_ / costmap_ros_->getCostmap()->getResolution();
+        window_width_ = std::min(2 * margin + 1, size_x);
+        window_height_ = std::min(2 * margin + 1, size_y);
+        window_x_ = (size_x - window_width_) / 2;
+        window_y_ = (size_y - window_height_) / 2;
+        current_env_width_ = window_width_;
+        current_env_height_ = window_height_;
+      }
     }
-    catch(SBPL_Exception *e){
-      ROS_ERROR("SBPL encountered a fatal exception: %s", e->what());
-      ret = false;
+    else{
+      // The environment never shrinks, so that makePlan can follow a costmap
+      // that gets smaller (or grows back) without setting up sbpl again.
+      window_x_ = 0;
+      window_y_ = 0;
+      window_width_ = size_x;
+      window_height_ = size_y;
+      current_env_width_ = std::max(size_x, current_env_width_);
+      current_env_height_ = std::max(size_y, current_env_height_);
     }
-    if(!ret){
+    vector<unsigned char> sbpl_costs;
+    convertCostmap(sbpl_costs);
+
+    env_ = createEnvironment(current_env_width_, current_env_height_, sbpl_costs.data(),
+                                        costmap_ros_->getCostmap()->getResolution(), primitive_filename_);
+    if(!env_){
       ROS_ERROR("SBPL initialization failed!");
       exit(1);
     }
-    for (ssize_t ix(0); ix < costmap_ros_->getCostmap()->getSizeInCellsX(); ++ix)
-      for (ssize_t iy(0); iy < costmap_ros_->getCostmap()->getSizeInCellsY(); ++iy)
-        env_->UpdateCost(ix, iy, costMapCostToSBPLCost(costmap_ros_->getCostmap()->getCost(ix,iy)));
+    current_map_width_ = size_x;
+    current_map_height_ = size_y;
 
-    if ("ARAPlanner" == planner_type_){
-      ROS_INFO("Planning with ARA*");
-      planner_ = new ARAPlanner(env_, forward_search_);
-    }
-    else if ("ADPlanner" == planner_type_){
-      ROS_INFO("Planning with AD*");
-      planner_ = new ADPlanner(env_, forward_search_);
+    // remember what we synced so makePlan only has to look at cells that changed since
+    takeCostmapSnapshot();
+
+    if ("Portfolio" == planner_type_){
+      loadPortfolio(private_nh);
+      for(unsigned int i = 0; i < portfolio_.size(); ++i){
+        PlannerWorker& entry = portfolio_[i];
+        // the first configuration searches in env_, which makePlan keeps in
+        // sync with the costmap; the others get their own copy of the map
+        entry.env = i == 0 ? env_ : createEnvironment(current_env_width_, current_env_height_, sbpl_costs.data(),
+                                        costmap_ros_->getCostmap()->getResolution(), primitive_filename_);
+        if(entry.env)
+          entry.planner = createPlanner(entry.planner_type, entry.env, entry.forward_search);
+        if(!entry.planner){
+          ROS_ERROR("Failed to set up portfolio configuration %s", entry.name.c_str());
+          exit(1);
+        }
+      }
+      planner_ = portfolio_[0].planner;
+
+      if(async_planning_){
+        ROS_WARN("async_planning is not supported by the Portfolio planner type, ignoring it");
+        async_planning_ = false;
+      }
     }
     else{
-      ROS_ERROR("ARAPlanner and ADPlanner are currently the only supported planners!\n");
-      exit(1);
+      planner_ = createPlanner(planner_type_, env_, forward_search_);
+      if(!planner_)
+        exit(1);
+    }
+
+    if(!coarse_primitive_filename_.empty()){
+      if(!portfolio_.empty())
+        ROS_WARN("Hierarchical planning is not supported by the Portfolio planner type, ignoring coarse_primitive_filename");
+      else if(coarse_factor_ < 2)
+        ROS_WARN("coarse_factor must be at least 2, hierarchical planning is off");
+      else
+        createCoarseLattice(sbpl_costs);
+    }
+
+    // env_ and planner_ are the first worker for batched queries, the others
+    // use the same configuration in an environment of their own
+    for(int i = 1; i < batch_workers; ++i){
+      PlannerWorker worker;
+      if(portfolio_.empty()){
+        worker.planner_type = planner_type_;
+        worker.initial_epsilon = initial_epsilon_;
+        worker.forward_search = forward_search_;
+      }
+      else{
+        worker.planner_type = portfolio_[0].planner_type;
+        worker.initial_epsilon = portfolio_[0].initial_epsilon;
+        worker.forward_search = portfolio_[0].forward_search;
+      }
+      std::ostringstream worker_name;
+      worker_name << "batch worker " << i;
+      worker.name = worker_name.str();
+      worker.env = createEnvironment(current_env_width_, current_env_height_, sbpl_costs.data(),
+                                        costmap_ros_->getCostmap()->getResolution(), primitive_filename_);
+      if(worker.env)
+        worker.planner = createPlanner(worker.planner_type, worker.env, worker.forward_search);
+      if(!worker.planner){
+        ROS_ERROR("Failed to set up %s", worker.name.c_str());
+        exit(1);
+      }
+      batch_workers_.push_back(worker);
     }
 
+    if(async_planning_ && !planning_thread_)
+      planning_thread_ = new boost::thread(boost::bind(&SBPLLatticePlanner::planningThread, this));
+
     ROS_INFO("[sbpl_lattice_planner] Initialized successfully");
     plan_pub_ = private_nh.advertise<nav_msgs::Path>("plan", 1);
     stats_publisher_ = private_nh.advertise<sbpl_lattice_planner::SBPLLatticePlannerStats>("sbpl_lattice_planner_stats", 1);
+    // reinitialize() comes through here again, and a second advertise would take the service down
+    if(!make_plans_srv_)
+      make_plans_srv_ = private_nh.advertiseService("make_plans", &SBPLLatticePlanner::makePlansService, this);
     
     initialized_ = true;
   }
 }
   
+EnvironmentNAVXYTHETALAT* SBPLLatticePlanner::createEnvironment(unsigned int width, unsigned int height,
+                                                                const unsigned char* mapdata, double cellsize,
+                                                                const std::string& primitive_filename){
+  LatticeEnvironment* env = new LatticeEnvironment();
+
+  if(!env->SetEnvParameter("cost_inscribed_thresh",costMapCostToSBPLCost(costmap_2d::INSCRIBED_INFLATED_OBSTACLE))){
+    ROS_ERROR("Failed to set cost_inscribed_thresh parameter");
+    delete env;
+    return NULL;
+  }
+  if(!env->SetEnvParameter("cost_possibly_circumscribed_thresh", circumscribed_cost_)){
+    ROS_ERROR("Failed to set cost_possibly_circumscribed_thresh parameter");
+    delete env;
+    return NULL;
+  }
+  int obst_cost_thresh = costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE);
+  vector<sbpl_2Dpt_t> perimeterptsV;
+  perimeterptsV.reserve(footprint_.size());
+  for (size_t ii(0); ii < footprint_.size(); ++ii) {
+    sbpl_2Dpt_t pt;
+    pt.x = footprint_[ii].x;
+    pt.y = footprint_[ii].y;
+    perimeterptsV.push_back(pt);
+  }
+
+  // InitializeEnv parses the primitive file and precomputes the cells swept
+  // by every primitive for the footprint, the cache takes the place of that
+  ros::WallTime init_start = ros::WallTime::now();
+  std::string cache_path;
+  uint64_t cache_key = 0;
+  if(primitive_cache_ && primitiveCacheKey(primitive_filename, perimeterptsV, cellsize, cache_key)){
+    std::ostringstream path;
+    const char* basename = strrchr(primitive_filename.c_str(), '/');
+    path << primitive_cache_dir_ << "/" << (basename ? basename + 1 : primitive_filename.c_str()) << "."
+         << std::hex << cache_key << ".cache";
+    cache_path = path.str();
+  }
+  bool ret = false;
+  try{
+    if(!cache_path.empty() &&
+       env->initializeFromPrimitiveTables(cache_path, cache_key, width, height, mapdata, perimeterptsV, cellsize,
+                                          nominalvel_mpersecs_, timetoturn45degsinplace_secs_, obst_cost_thresh)){
+      ROS_INFO("Initialized the sbpl environment (%u x %u cells) from %s in %f sec", width, height,
+               cache_path.c_str(), (ros::WallTime::now() - init_start).toSec());
+      return env;
+    }
+    ret = env->InitializeEnv(width, // width
+                             height, // height
+                             mapdata, // mapdata
+                             0, 0, 0, // start (x, y, theta, t)
+                             0, 0, 0, // goal (x, y, theta)
+                             0, 0, 0, //goal tolerance
+                             perimeterptsV, cellsize, nominalvel_mpersecs_,
+                             timetoturn45degsinplace_secs_, obst_cost_thresh,
+                             primitive_filename.c_str());
+  }
+  catch(SBPL_Exception *e){
+    ROS_ERROR("SBPL encountered a fatal exception: %s", e->what());
+    ret = false;
+  }
+  if(!ret){
+    delete env;
+    return NULL;
+  }
+  ROS_INFO("Initialized the sbpl environment (%u x %u cells) in %f sec", width, height,
+           (ros::WallTime::now() - init_start).toSec());
+  if(!cache_path.empty()){
+    if(env->savePrimitiveTables(cache_path, cache_key))
+      ROS_INFO("Saved the motion primitive tables to %s", cache_path.c_str());
+    else
+      ROS_WARN("Failed to save the motion primitive tables to %s", cache_path.c_str());
+  }
+  return env;
+}
+
+bool SBPLLatticePlanner::primitiveCacheKey(const std::string& primitive_filename,
+                                           const std::vector<sbpl_2Dpt_t>& perimeterptsV, double cellsize,
+                                           uint64_t& key) const{
+  std::ifstream file(primitive_filename.c_str(), std::ios::binary);
+  if(!file)
+    return false;
+  std::string primitives((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  // the action costs come from the velocities, the swept cells from the
+  // footprint and the resolution, and the size of sbpl's action struct
+  // changes with its layout
+  Fnv1aHash hash;
+  hash.add(primitives.data(), primitives.size());
+  for(size_t i = 0; i < perimeterptsV.size(); ++i){
+    hash.add(perimeterptsV[i].x);
+    hash.add(perimeterptsV[i].y);
+  }
+  hash.add(cellsize);
+  hash.add(nominalvel_mpersecs_);
+  hash.add(timetoturn45degsinplace_secs_);
+  hash.add(sizeof(EnvNAVXYTHETALATAction_t));
+  key = hash.value();
+  return true;
+}
+
+void SBPLLatticePlanner::createCoarseLattice(const std::vector<unsigned char>& sbpl_costs){
+  coarse_env_width_ = (current_env_width_ + coarse_factor_ - 1) / coarse_factor_;
+  coarse_env_height_ = (current_env_height_ + coarse_factor_ - 1) / coarse_factor_;
+  vector<unsigned char> coarse_costs;
+  downsampleCosts(sbpl_costs, coarse_costs);
+
+  // the coarse primitives must be generated for this cell size
+  coarse_env_ = createEnvironment(coarse_env_width_, coarse_env_height_, coarse_costs.data(),
+                                  coarse_factor_ * costmap_ros_->getCostmap()->getResolution(),
+                                  coarse_primitive_filename_);
+  if(coarse_env_)
+    coarse_planner_ = createPlanner(planner_type_, coarse_env_, forward_search_);
+  if(!coarse_planner_){
+    ROS_ERROR("Failed to set up the coarse lattice");
+    exit(1);
+  }
+  coarse_path_.clear();
+  coarse_split_ = 0;
+}
+
+void SBPLLatticePlanner::downsampleCosts(const std::vector<unsigned char>& sbpl_costs,
+                                         std::vector<unsigned char>& coarse_costs) const{
+  // taking the highest cost keeps the coarse lattice from cutting corners
+  // the fine one could not; coarse plans can only miss narrow passages
+  coarse_costs.assign(coarse_env_width_ * coarse_env_height_, 0);
+  for(unsigned int y = 0; y < current_env_height_; ++y){
+    const unsigned char* row = &sbpl_costs[y * current_env_width_];
+    unsigned char* coarse_row = &coarse_costs[(y / coarse_factor_) * coarse_env_width_];
+    for(unsigned int x = 0; x < current_env_width_; ++x)
+      coarse_row[x / coarse_factor_] = std::max(coarse_row[x / coarse_factor_], row[x]);
+  }
+
+  // coarse cells that reach beyond the fine environment are blocked
+  const unsigned char sbpl_lethal = costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE);
+  if(current_env_width_ % coarse_factor_){
+    for(unsigned int y = 0; y < coarse_env_height_; ++y)
+      coarse_costs[y * coarse_env_width_ + coarse_env_width_ - 1] = sbpl_lethal;
+  }
+  if(current_env_height_ % coarse_factor_)
+    std::fill(coarse_costs.end() - coarse_env_width_, coarse_costs.end(), sbpl_lethal);
+}
+
+SBPLPlanner* SBPLLatticePlanner::createPlanner(const std::string& planner_type, EnvironmentNAVXYTHETALAT* env,
+                                               bool forward_search){
+  if ("ARAPlanner" == planner_type){
+    ROS_INFO("Planning with ARA*");
+    return new ARAPlanner(env, forward_search);
+  }
+  else if ("ADPlanner" == planner_type){
+    ROS_INFO("Planning with AD*");
+    return new ADPlanner(env, forward_search);
+  }
+  ROS_ERROR("ARAPlanner and ADPlanner are currently the only supported planners!\n");
+  return NULL;
+}
+
+static double xmlRpcToDouble(XmlRpc::XmlRpcValue& value){
+  if(value.getType() == XmlRpc::XmlRpcValue::TypeInt)
+    return static_cast<int>(value);
+  return static_cast<double>(value);
+}
+
+void SBPLLatticePlanner::loadPortfolio(ros::NodeHandle& private_nh){
+  portfolio_.clear();
+
+  XmlRpc::XmlRpcValue configurations;
+  if(!private_nh.getParam("portfolio", configurations)){
+    // race the incremental planner against the one that starts over
+    PlannerWorker ara, ad;
+    ara.planner_type = "ARAPlanner";
+    ad.planner_type = "ADPlanner";
+    portfolio_.push_back(ara);
+    portfolio_.push_back(ad);
+    for(unsigned int i = 0; i < portfolio_.size(); ++i){
+      portfolio_[i].initial_epsilon = initial_epsilon_;
+      portfolio_[i].forward_search = forward_search_;
+    }
+  }
+  else{
+    try{
+      if(configurations.getType() != XmlRpc::XmlRpcValue::TypeArray || configurations.size() == 0){
+        ROS_ERROR("The portfolio parameter must be a non-empty list of planner configurations");
+        exit(1);
+      }
+      for(int i = 0; i < configurations.size(); ++i){
+        XmlRpc::XmlRpcValue& config = configurations[i];
+        if(config.getType() != XmlRpc::XmlRpcValue::TypeStruct){
+          ROS_ERROR("Entry %d of the portfolio parameter is not a planner configuration", i);
+          exit(1);
+        }
+        PlannerWorker entry;
+        entry.planner_type = config.hasMember("planner_type") ? static_cast<std::string>(config["planner_type"]) : string("ARAPlanner");
+        entry.initial_epsilon = config.hasMember("initial_epsilon") ? xmlRpcToDouble(config["initial_epsilon"]) : initial_epsilon_;
+        entry.forward_search = config.hasMember("forward_search") ? static_cast<bool>(config["forward_search"]) : forward_search_;
+        if(config.hasMember("name"))
+          entry.name = static_cast<std::string>(config["name"]);
+        portfolio_.push_back(entry);
+      }
+    }
+    catch(XmlRpc::XmlRpcException& e){
+      ROS_ERROR("Failed to parse the portfolio parameter: %s", e.getMessage().c_str());
+      exit(1);
+    }
+  }
+
+  for(unsigned int i = 0; i < portfolio_.size(); ++i){
+    PlannerWorker& entry = portfolio_[i];
+    if(entry.name.empty()){
+      std::ostringstream name;
+      name << entry.planner_type << "/eps=" << entry.initial_epsilon << (entry.forward_search ? "/forward" : "/backward");
+      entry.name = name.str();
+    }
+    ROS_INFO("Portfolio configuration %u: %s", i, entry.name.c_str());
+  }
+}
+
+void SBPLLatticePlanner::convertCostmap(std::vector<unsigned char>& sbpl_costs) const{
+  const unsigned int size_x = costmap_ros_->getCostmap()->getSizeInCellsX();
+  const unsigned char* charmap = costmap_ros_->getCostmap()->getCharMap() + window_y_ * size_x + window_x_;
+  const unsigned int width = current_env_width_;
+  const unsigned char sbpl_lethal = costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE);
+
+  // The costmap is stored row-major, which is also the layout sbpl expects
+  // for its mapdata argument, so the map is converted row by row (or in one
+  // linear pass if the widths match) instead of cell by cell.
+  sbpl_costs.resize(current_env_width_ * current_env_height_);
+  if(window_width_ == size_x && size_x == width)
+    costMapCostsToSBPLCosts(charmap, sbpl_costs.data(), size_x * window_height_);
+  else{
+    for(unsigned int y = 0; y < window_height_; ++y){
+      costMapCostsToSBPLCosts(charmap + y * size_x, &sbpl_costs[y * width], window_width_);
+      memset(&sbpl_costs[y * width + window_width_], sbpl_lethal, width - window_width_);
+    }
+  }
+  // the part of the environment the window does not cover is blocked
+  std::fill(sbpl_costs.begin() + window_height_ * width, sbpl_costs.end(), sbpl_lethal);
+}
+
+void SBPLLatticePlanner::takeCostmapSnapshot(){
+  const unsigned int size_x = costmap_ros_->getCostmap()->getSizeInCellsX();
+  const unsigned char* charmap = costmap_ros_->getCostmap()->getCharMap() + window_y_ * size_x + window_x_;
+  costmap_snapshot_.resize(window_width_ * window_height_);
+  for(unsigned int y = 0; y < window_height_; ++y)
+    memcpy(&costmap_snapshot_[y * window_width_], charmap + y * size_x, window_width_);
+}
+
+void SBPLLatticePlanner::resizeEnvironments(){
+  vector<unsigned char> sbpl_costs;
+  convertCostmap(sbpl_costs);
+
+  // SetMap only overwrites the cost grid; primitives, precomputed action
+  // footprints and the state space stay as they are, and the heuristics are
+  // recomputed on the next search
+  env_->SetMap(sbpl_costs.data());
+  planner_->force_planning_from_scratch();
+  for(unsigned int i = 1; i < portfolio_.size(); ++i){
+    portfolio_[i].env->SetMap(sbpl_costs.data());
+    portfolio_[i].planner->force_planning_from_scratch();
+  }
+  if(coarse_env_){
+    vector<unsigned char> coarse_costs;
+    downsampleCosts(sbpl_costs, coarse_costs);
+    coarse_env_->SetMap(coarse_costs.data());
+    coarse_planner_->force_planning_from_scratch();
+  }
+
+  current_map_width_ = costmap_ros_->getCostmap()->getSizeInCellsX();
+  current_map_height_ = costmap_ros_->getCostmap()->getSizeInCellsY();
+  takeCostmapSnapshot();
+  // the last path is in the coordinates of the old window
+  solution_path_cells_.clear();
+}
+
+void SBPLLatticePlanner::reinitialize(){
+  initialized_ = false;
+  deleteWorkers();
+  delete planner_;
+  planner_ = NULL;
+  delete env_;
+  env_ = NULL;
+  initialize(name_, costmap_ros_);
+  solution_path_cells_.clear();
+}
+
+bool SBPLLatticePlanner::windowCoversCostmap() const{
+  return window_x_ == 0 && window_y_ == 0 &&
+         window_width_ == costmap_ros_->getCostmap()->getSizeInCellsX() &&
+         window_height_ == costmap_ros_->getCostmap()->getSizeInCellsY();
+}
+
+void SBPLLatticePlanner::updateWindow(const geometry_msgs::PoseStamped& start,
+                                      const std::vector<geometry_msgs::PoseStamped>& goals, double margin){
+  PhaseTimer timer;
+  const costmap_2d::Costmap2D* costmap = costmap_ros_->getCostmap();
+  const int size_x = costmap->getSizeInCellsX();
+  const int size_y = costmap->getSizeInCellsY();
+
+  // bounding box of start and goals plus the margin, clipped to the costmap
+  int min_x, min_y, max_x, max_y;
+  costmap->worldToMapNoBounds(start.pose.position.x, start.pose.position.y, min_x, min_y);
+  max_x = min_x;
+  max_y = min_y;
+  for(unsigned int i = 0; i < goals.size(); ++i){
+    int x, y;
+    costmap->worldToMapNoBounds(goals[i].pose.position.x, goals[i].pose.position.y, x, y);
+    min_x = std::min(min_x, x);
+    min_y = std::min(min_y, y);
+    max_x = std::max(max_x, x);
+    max_y = std::max(max_y, y);
+  }
+  const int margin_cells = margin / costmap->getResolution();
+  const int needed_x = std::min(std::max(min_x - margin_cells, 0), size_x - 1);
+  const int needed_y = std::min(std::max(min_y - margin_cells, 0), size_y - 1);
+  const int needed_width = std::min(std::max(max_x + margin_cells + 1, needed_x + 1), size_x) - needed_x;
+  const int needed_height = std::min(std::max(max_y + margin_cells + 1, needed_y + 1), size_y) - needed_y;
+
+  // keep the window as long as it still covers the query; an environment
+  // that holds on to a lot more memory than needed is only shrunk once that
+  // has been the case for window_shrink_count queries in a row, so that goals
+  // alternating between near and far do not rebuild it every time
+  const unsigned int needed_area = needed_width * needed_height;
+  if(current_env_width_ * current_env_height_ > 4 * needed_area)
+    window_oversized_count_++;
+  else
+    window_oversized_count_ = 0;
+  const bool shrink = window_oversized_count_ >= (unsigned int)std::max(window_shrink_count_, 1);
+  if(!shrink && current_map_width_ == (unsigned int)size_x && current_map_height_ == (unsigned int)size_y &&
+     needed_x >= (int)window_x_ && needed_y >= (int)window_y_ &&
+     needed_x + needed_width <= (int)(window_x_ + window_width_) &&
+     needed_y + needed_height <= (int)(window_y_ + window_height_))
+    return;
+
+  const bool fits = needed_width <= (int)current_env_width_ && needed_height <= (int)current_env_height_;
+  if(shrink || !fits){
+    // leave some slack around what is needed, so that the next queries can
+    // move the window instead of reinitializing
+    current_env_width_ = std::min((int)std::ceil(needed_width * window_growth_), size_x);
+    current_env_height_ = std::min((int)std::ceil(needed_height * window_growth_), size_y);
+    window_oversized_count_ = 0;
+  }
+
+  // use as much of the environment as the costmap allows, centered on what
+  // is needed
+  window_width_ = std::min((int)current_env_width_, size_x);
+  window_height_ = std::min((int)current_env_height_, size_y);
+  window_x_ = std::min(std::max(needed_x - ((int)window_width_ - needed_width) / 2, 0), size_x - (int)window_width_);
+  window_y_ = std::min(std::max(needed_y - ((int)window_height_ - needed_height) / 2, 0), size_y - (int)window_height_);
+  if(!shrink && fits){
+    // sbpl keeps its primitives and only loads the new costs
+    ROS_DEBUG("Moving the planning window to (%u, %u), %u x %u cells", window_x_, window_y_, window_width_, window_height_);
+    resizeEnvironments();
+    phase_stats_.resized = true;
+  }
+  else{
+    ROS_INFO("Planning window at (%u, %u) needs %u x %u cells, reinitializing sbpl_lattice_planner with %u x %u cells.",
+             needed_x, needed_y, needed_width, needed_height, window_width_, window_height_);
+    reinitialize();
+    phase_stats_.reinitialized = true;
+  }
+
+  // the time is accounted to the reinit phase along with updateEnvironments
+  double wall_time, cpu_time;
+  timer.stop(wall_time, cpu_time);
+  phase_stats_.reinit_wall_time += wall_time;
+  phase_stats_.reinit_cpu_time += cpu_time;
+}
+
+void SBPLLatticePlanner::updateCircumscribedCost(unsigned char circumscribed_cost){
+  circumscribed_cost_ = circumscribed_cost;
+
+  // all environments are created by createEnvironment
+  static_cast<LatticeEnvironment*>(env_)->setPossiblyCircumscribedThresh(circumscribed_cost_);
+  planner_->force_planning_from_scratch();
+  for(unsigned int i = 1; i < portfolio_.size(); ++i){
+    static_cast<LatticeEnvironment*>(portfolio_[i].env)->setPossiblyCircumscribedThresh(circumscribed_cost_);
+    portfolio_[i].planner->force_planning_from_scratch();
+  }
+  if(coarse_env_){
+    static_cast<LatticeEnvironment*>(coarse_env_)->setPossiblyCircumscribedThresh(circumscribed_cost_);
+    coarse_planner_->force_planning_from_scratch();
+  }
+  for(unsigned int i = 0; i < batch_workers_.size(); ++i){
+    static_cast<LatticeEnvironment*>(batch_workers_[i].env)->setPossiblyCircumscribedThresh(circumscribed_cost_);
+    batch_workers_[i].planner->force_planning_from_scratch();
+  }
+}
+
+void SBPLLatticePlanner::joinPortfolio(){
+  portfolio_stop_ = true;
+  for(unsigned int i = 0; i < portfolio_.size(); ++i){
+    if(portfolio_[i].thread){
+      portfolio_[i].thread->join();
+      portfolio_[i].thread.reset();
+    }
+  }
+  portfolio_stop_ = false;
+}
+
+void SBPLLatticePlanner::deleteWorkers(){
+  joinPortfolio();
+  // the first portfolio entry is owned through env_ and planner_
+  for(unsigned int i = 1; i < portfolio_.size(); ++i){
+    delete portfolio_[i].planner;
+    delete portfolio_[i].env;
+  }
+  portfolio_.clear();
+  for(unsigned int i = 0; i < batch_workers_.size(); ++i){
+    delete batch_workers_[i].planner;
+    delete batch_workers_[i].env;
+  }
+  batch_workers_.clear();
+  delete coarse_planner_;
+  coarse_planner_ = NULL;
+  delete coarse_env_;
+  coarse_env_ = NULL;
+}
+
 //Taken from Sachin's sbpl_cart_planner
-//This rescales the costmap according to a rosparam which sets the obstacle cost
-unsigned char SBPLLatticePlanner::costMapCostToSBPLCost(unsigned char newcost){
-  if(newcost == costmap_2d::LETHAL_OBSTACLE)
-    return lethal_obstacle_;
-  else if(newcost == costmap_2d::INSCRIBED_INFLATED_OBSTACLE)
-    return inscribed_inflated_obstacle_;
-  else if(newcost == 0 || newcost == costmap_2d::NO_INFORMATION)
-    return 0;
-  else {
-    unsigned char sbpl_cost = newcost / sbpl_cost_multiplier_;
-    if (sbpl_cost == 0)
-      sbpl_cost = 1;
-    return sbpl_cost;
+//This rescales the costmap according to a rosparam which sets the obstacle cost.
+//The mapping only depends on lethal_obstacle_ and sbpl_cost_multiplier_, so it
+//is tabulated for all 256 costmap values whenever either of them is set.
+void SBPLLatticePlanner::computeCostTranslationTable(){
+  for(unsigned int newcost = 0; newcost < 256; ++newcost){
+    unsigned char sbpl_cost;
+    if(newcost == costmap_2d::LETHAL_OBSTACLE)
+      sbpl_cost = lethal_obstacle_;
+    else if(newcost == costmap_2d::INSCRIBED_INFLATED_OBSTACLE)
+      sbpl_cost = inscribed_inflated_obstacle_;
+    else if(newcost == 0 || newcost == costmap_2d::NO_INFORMATION)
+      sbpl_cost = 0;
+    else {
+      sbpl_cost = newcost / sbpl_cost_multiplier_;
+      if (sbpl_cost == 0)
+        sbpl_cost = 1;
+    }
+    cost_translation_table_[newcost] = sbpl_cost;
   }
 }
 
-void SBPLLatticePlanner::publishStats(int solution_cost, int solution_size, 
+unsigned char SBPLLatticePlanner::costMapCostToSBPLCost(unsigned char newcost) const{
+  return cost_translation_table_[newcost];
+}
+
+void SBPLLatticePlanner::costMapCostsToSBPLCosts(const unsigned char* costs, unsigned char* sbpl_costs,
+                                                 unsigned int n) const{
+  // a plain table lookup per byte; the loop has no branches and no carried
+  // dependencies, so it runs at memory speed on whole costmap rows
+  const unsigned char* table = cost_translation_table_;
+  for(unsigned int i = 0; i < n; ++i)
+    sbpl_costs[i] = table[costs[i]];
+}
+
+void SBPLLatticePlanner::publishStats(const sbpl_lattice_planner::SBPLLatticePlannerStats& phase_stats,
+                                      SBPLPlanner* planner, double initial_epsilon, const std::string& configuration,
+                                      int solution_cost, int solution_size, 
                                       const geometry_msgs::PoseStamped& start, 
                                       const geometry_msgs::PoseStamped& goal){
   // Fill up statistics and publish
-  sbpl_lattice_planner::SBPLLatticePlannerStats stats;
-  stats.initial_epsilon = initial_epsilon_;
+  sbpl_lattice_planner::SBPLLatticePlannerStats stats = phase_stats;
+  stats.initial_epsilon = initial_epsilon;
   stats.plan_to_first_solution = false;
-  stats.final_number_of_expands = planner_->get_n_expands();
+  stats.final_number_of_expands = planner->get_n_expands();
   stats.allocated_time = allocated_time_;
 
-  stats.time_to_first_solution = planner_->get_initial_eps_planning_time();
-  stats.actual_time = planner_->get_final_eps_planning_time();
-  stats.number_of_expands_initial_solution = planner_->get_n_expands_init_solution();
-  stats.final_epsilon = planner_->get_final_epsilon();
+  stats.time_to_first_solution = planner->get_initial_eps_planning_time();
+  stats.actual_time = planner->get_final_eps_planning_time();
+  stats.number_of_expands_initial_solution = planner->get_n_expands_init_solution();
+  stats.final_epsilon = planner->get_final_epsilon();
+  stats.planner_configuration = configuration;
 
   stats.solution_cost = solution_cost;
   stats.path_size = solution_size;
@@ -270,179 +1155,861 @@ unsigned char SBPLLatticePlanner::computeCircumscribedCost() {
   return result;
 }
 
-bool SBPLLatticePlanner::makePlan(const geometry_msgs::PoseStamped& start,
-                                 const geometry_msgs::PoseStamped& goal,
-                                 std::vector<geometry_msgs::PoseStamped>& plan){
-  if(!initialized_){
-    ROS_ERROR("Global planner is not initialized");
-    return false;
-  }
+void SBPLLatticePlanner::updateEnvironments(){
+  PhaseTimer timer;
 
+  // Only a new footprint or a costmap that outgrows the environment need a
+  // new environment. Everything else is updated in place, which keeps the
+  // motion primitives and their precomputed footprints.
+  const unsigned int costmap_size_x = costmap_ros_->getCostmap()->getSizeInCellsX();
+  const unsigned int costmap_size_y = costmap_ros_->getCostmap()->getSizeInCellsY();
   bool do_init = false;
-  if (current_env_width_ != costmap_ros_->getCostmap()->getSizeInCellsX() ||
-      current_env_height_ != costmap_ros_->getCostmap()->getSizeInCellsY()) {
-    ROS_INFO("Costmap dimensions have changed from (%d x %d) to (%d x %d), reinitializing sbpl_lattice_planner.",
-             current_env_width_, current_env_height_,
-             costmap_ros_->getCostmap()->getSizeInCellsX(), costmap_ros_->getCostmap()->getSizeInCellsY());
-    do_init = true;
-  }
-  else if (footprint_ != costmap_ros_->getRobotFootprint()) {
+  bool do_resize = false;
+  if (footprint_ != costmap_ros_->getRobotFootprint()) {
     ROS_INFO("Robot footprint has changed, reinitializing sbpl_lattice_planner.");
     do_init = true;
   }
-  else if (circumscribed_cost_ != computeCircumscribedCost()) {
-    ROS_INFO("Cost at circumscribed radius has changed, reinitializing sbpl_lattice_planner.");
-    do_init = true;
+  else if (!planning_window_ && (current_map_width_ != costmap_size_x || current_map_height_ != costmap_size_y)) {
+    if (costmap_size_x <= current_env_width_ && costmap_size_y <= current_env_height_) {
+      ROS_INFO("Costmap dimensions have changed from (%d x %d) to (%d x %d), resizing the sbpl environment in place.",
+               current_map_width_, current_map_height_, costmap_size_x, costmap_size_y);
+      do_resize = true;
+    }
+    else {
+      ROS_INFO("Costmap dimensions have changed from (%d x %d) to (%d x %d), reinitializing sbpl_lattice_planner.",
+               current_map_width_, current_map_height_, costmap_size_x, costmap_size_y);
+      do_init = true;
+    }
   }
 
+  if (!do_init) {
+    unsigned char circumscribed_cost = computeCircumscribedCost();
+    if (circumscribed_cost_ != circumscribed_cost) {
+      ROS_INFO("Cost at circumscribed radius has changed, updating sbpl_lattice_planner.");
+      updateCircumscribedCost(circumscribed_cost);
+    }
+  }
+
+  phase_stats_.reinitialized = do_init;
+  phase_stats_.resized = do_resize;
   if (do_init) {
-    initialized_ = false;
-    delete planner_;
-    planner_ = NULL;
-    delete env_;
-    env_ = NULL;
-    initialize(name_, costmap_ros_);
+    reinitialize();
+  }
+  else if (do_resize) {
+    window_width_ = costmap_size_x;
+    window_height_ = costmap_size_y;
+    resizeEnvironments();
   }
+  timer.stop(phase_stats_.reinit_wall_time, phase_stats_.reinit_cpu_time);
+}
 
-  plan.clear();
+bool SBPLLatticePlanner::syncCostmap(std::vector<nav2dcell_t>& changedcellsV, bool& plan_from_scratch){
+  PhaseTimer sync_timer;
+  int offOnCount = 0;
+  int onOffCount = 0;
+  int allCount = 0;
+  changedcellsV.clear();
 
-  ROS_INFO("[sbpl_lattice_planner] getting start point (%g,%g) goal point (%g,%g)",
-           start.pose.position.x, start.pose.position.y,goal.pose.position.x, goal.pose.position.y);
-  double theta_start = 2 * atan2(start.pose.orientation.z, start.pose.orientation.w);
-  double theta_goal = 2 * atan2(goal.pose.orientation.z, goal.pose.orientation.w);
+  // Compare against the snapshot of the costmap taken at the last sync instead
+  // of querying sbpl for every cell. Both buffers are walked linearly in
+  // blocks, and blocks that did not change are skipped with a single memcmp,
+  // so the work done here is dominated by the dirty regions. Only the
+  // planning window is looked at; it is one linear range if it spans whole
+  // costmap rows.
+  const unsigned int size_x = costmap_ros_->getCostmap()->getSizeInCellsX();
+  const bool contiguous = window_x_ == 0 && window_width_ == size_x;
+  const unsigned int rows = contiguous ? 1 : window_height_;
+  const unsigned int row_length = contiguous ? window_width_ * window_height_ : window_width_;
+  const unsigned int block_size = 64;
+  const double resolution = costmap_ros_->getCostmap()->getResolution();
+  env_origin_x_ = costmap_ros_->getCostmap()->getOriginX() + window_x_ * resolution;
+  env_origin_y_ = costmap_ros_->getCostmap()->getOriginY() + window_y_ * resolution;
+  const unsigned char sbpl_lethal = costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE);
+  const unsigned char sbpl_inscribed = costMapCostToSBPLCost(costmap_2d::INSCRIBED_INFLATED_OBSTACLE);
+
+  for(unsigned int row = 0; row < rows; ++row) {
+    const unsigned char* charmap = costmap_ros_->getCostmap()->getCharMap() + (window_y_ + row) * size_x + window_x_;
+    unsigned char* snapshot = costmap_snapshot_.data() + row * row_length;
+    for(unsigned int block = 0; block < row_length; block += block_size) {
+      const unsigned int block_end = std::min(block + block_size, row_length);
+      if(memcmp(charmap + block, snapshot + block, block_end - block) == 0) continue;
+
+      for(unsigned int index = block; index < block_end; index++) {
+        if(charmap[index] == snapshot[index]) continue;
+
+        unsigned char oldCost = costMapCostToSBPLCost(snapshot[index]);
+        unsigned char newCost = costMapCostToSBPLCost(charmap[index]);
+        snapshot[index] = charmap[index];
+
+        if(oldCost == newCost) continue;
+
+        allCount++;
 
+        bool oldBlocked = oldCost == sbpl_lethal || oldCost == sbpl_inscribed;
+        bool newBlocked = newCost == sbpl_lethal || newCost == sbpl_inscribed;
+
+        //first case - off cell goes on
+        if(!oldBlocked && newBlocked)
+          offOnCount++;
+
+        //second case - on cell goes off
+        if(oldBlocked && !newBlocked)
+          onOffCount++;
+
+        nav2dcell_t nav2dcell;
+        nav2dcell.x = (row * row_length + index) % window_width_;
+        nav2dcell.y = (row * row_length + index) / window_width_;
+        env_->UpdateCost(nav2dcell.x, nav2dcell.y, newCost);
+
+        changedcellsV.push_back(nav2dcell);
+      }
+    }
+  }
+
+  sync_timer.stop(phase_stats_.costmap_sync_wall_time, phase_stats_.costmap_sync_cpu_time);
+  phase_stats_.changed_cells = allCount;
+  phase_stats_.off_on_cells = offOnCount;
+  phase_stats_.on_off_cells = onOffCount;
+
+  plan_from_scratch = choosePlanFromScratch(changedcellsV, allCount);
+  phase_stats_.forced_scratch = plan_from_scratch;
   try{
-    int ret = env_->SetStart(start.pose.position.x - costmap_ros_->getCostmap()->getOriginX(), start.pose.position.y - costmap_ros_->getCostmap()->getOriginY(), theta_start);
-    if(ret < 0 || planner_->set_start(ret) == 0){
-      ROS_ERROR("ERROR: failed to set start state\n");
-      return false;
+    PhaseTimer costs_changed_timer;
+    if(!changedcellsV.empty()){
+      StateChangeQuery* scq = new LatticeSCQ(env_, changedcellsV);
+      planner_->costs_changed(*scq);
+      delete scq;
     }
+    costs_changed_timer.stop(phase_stats_.costs_changed_wall_time, phase_stats_.costs_changed_cpu_time);
+
+    PhaseTimer force_scratch_timer;
+    if(plan_from_scratch)
+      planner_->force_planning_from_scratch();
+    force_scratch_timer.stop(phase_stats_.force_scratch_wall_time, phase_stats_.force_scratch_cpu_time);
   }
   catch(SBPL_Exception *e){
-    ROS_ERROR("SBPL encountered a fatal exception while setting the start state");
+    ROS_ERROR("SBPL failed to update the costmap");
+    return false;
+  }
+  return true;
+}
+
+void SBPLLatticePlanner::ReplanCostModel::addSample(double x, double y, double decay){
+  weight = decay * weight + 1.0;
+  sum_x = decay * sum_x + x;
+  sum_y = decay * sum_y + y;
+  sum_xx = decay * sum_xx + x * x;
+  sum_xy = decay * sum_xy + x * y;
+}
+
+bool SBPLLatticePlanner::ReplanCostModel::predict(double x, double& y) const{
+  if(weight <= 0.0)
     return false;
+
+  double mean_x = sum_x / weight;
+  double mean_y = sum_y / weight;
+  double variance_x = sum_xx / weight - mean_x * mean_x;
+  // with (almost) no spread in x this degrades to the mean; more changed
+  // cells never make a replan cheaper
+  double slope = 0.0;
+  if(variance_x > 1e-9)
+    slope = std::max(0.0, (sum_xy / weight - mean_x * mean_y) / variance_x);
+  y = std::max(0.0, mean_y + slope * (x - mean_x));
+  return true;
+}
+
+bool SBPLLatticePlanner::choosePlanFromScratch(const std::vector<nav2dcell_t>& changedcellsV, int changed_cells){
+  if(!adaptive_force_scratch_)
+    return changed_cells > force_scratch_limit_;
+
+  phase_stats_.weighted_changed_cells = weightChangedCells(changedcellsV);
+
+  // stick to the fixed limit until both kinds of replans have been seen
+  double repair_cost, scratch_cost;
+  if(!repair_cost_model_.predict(phase_stats_.weighted_changed_cells, repair_cost) ||
+     !scratch_cost_model_.predict(phase_stats_.weighted_changed_cells, scratch_cost))
+    return changed_cells > force_scratch_limit_;
+
+  ROS_DEBUG("%d changed cells (weighted %f), expected repair %f sec, from scratch %f sec",
+            changed_cells, phase_stats_.weighted_changed_cells, repair_cost, scratch_cost);
+  return repair_cost > scratch_cost;
+}
+
+double SBPLLatticePlanner::weightChangedCells(const std::vector<nav2dcell_t>& changedcellsV) const{
+  if(solution_path_cells_.empty() || adaptive_far_weight_ >= 1.0)
+    return changedcellsV.size();
+
+  // the path is sampled every half distance, so this covers roughly
+  // adaptive_path_distance_ around it
+  const double distance = 1.25 * adaptive_path_distance_ / costmap_ros_->getCostmap()->getResolution();
+  const double squared_distance = distance * distance;
+  double weight = 0.0;
+  for(unsigned int i = 0; i < changedcellsV.size(); ++i){
+    bool near_path = false;
+    for(unsigned int j = 0; j < solution_path_cells_.size() && !near_path; ++j){
+      double dx = changedcellsV[i].x - solution_path_cells_[j].x;
+      double dy = changedcellsV[i].y - solution_path_cells_[j].y;
+      near_path = dx * dx + dy * dy <= squared_distance;
+    }
+    weight += near_path ? 1.0 : adaptive_far_weight_;
+  }
+  return weight;
+}
+
+void SBPLLatticePlanner::updateReplanCostModel(bool from_scratch){
+  // what move_base waits for: bringing the search up to date plus the
+  // search for the first solution
+  double cost = planner_->get_initial_eps_planning_time() +
+                (from_scratch ? phase_stats_.force_scratch_wall_time : phase_stats_.costs_changed_wall_time);
+  double changes = adaptive_far_weight_ < 1.0 ? phase_stats_.weighted_changed_cells : phase_stats_.changed_cells;
+  if(from_scratch)
+    scratch_cost_model_.addSample(changes, cost, adaptive_decay_);
+  else
+    repair_cost_model_.addSample(changes, cost, adaptive_decay_);
+}
+
+void SBPLLatticePlanner::rememberSolutionPath(){
+  solution_path_cells_.clear();
+  if(!adaptive_force_scratch_ || adaptive_far_weight_ >= 1.0)
+    return;
+
+  const double resolution = costmap_ros_->getCostmap()->getResolution();
+  const double spacing = std::max(1.0, 0.5 * adaptive_path_distance_ / resolution);
+  for(unsigned int i = 0; i < sbpl_path_.size(); ++i){
+    nav2dcell_t cell;
+    cell.x = sbpl_path_[i].x / resolution;
+    cell.y = sbpl_path_[i].y / resolution;
+    if(!solution_path_cells_.empty() &&
+       std::hypot(cell.x - solution_path_cells_.back().x, cell.y - solution_path_cells_.back().y) < spacing)
+      continue;
+    solution_path_cells_.push_back(cell);
   }
+}
+
+bool SBPLLatticePlanner::syncCoarseLattice(const std::vector<nav2dcell_t>& changedcellsV, bool plan_from_scratch){
+  // every coarse cell touched by a change is pooled again from env_, once
+  std::vector<unsigned int> coarse_cells;
+  coarse_cells.reserve(changedcellsV.size());
+  for(unsigned int i = 0; i < changedcellsV.size(); ++i)
+    coarse_cells.push_back((changedcellsV[i].y / coarse_factor_) * coarse_env_width_ + changedcellsV[i].x / coarse_factor_);
+  std::sort(coarse_cells.begin(), coarse_cells.end());
+  coarse_cells.erase(std::unique(coarse_cells.begin(), coarse_cells.end()), coarse_cells.end());
 
+  std::vector<nav2dcell_t> coarse_changedcellsV;
   try{
-    int ret = env_->SetGoal(goal.pose.position.x - costmap_ros_->getCostmap()->getOriginX(), goal.pose.position.y - costmap_ros_->getCostmap()->getOriginY(), theta_goal);
-    if(ret < 0 || planner_->set_goal(ret) == 0){
-      ROS_ERROR("ERROR: failed to set goal state\n");
-      return false;
+    for(unsigned int i = 0; i < coarse_cells.size(); ++i){
+      nav2dcell_t coarse;
+      coarse.x = coarse_cells[i] % coarse_env_width_;
+      coarse.y = coarse_cells[i] / coarse_env_width_;
+      // cells at the border of the fine environment stay blocked, see downsampleCosts
+      const unsigned int x_end = (coarse.x + 1) * coarse_factor_;
+      const unsigned int y_end = (coarse.y + 1) * coarse_factor_;
+      if(x_end > current_env_width_ || y_end > current_env_height_)
+        continue;
+
+      unsigned char cost = 0;
+      for(unsigned int y = coarse.y * coarse_factor_; y < y_end; ++y){
+        for(unsigned int x = coarse.x * coarse_factor_; x < x_end; ++x)
+          cost = std::max(cost, env_->GetMapCost(x, y));
+      }
+      if(cost == coarse_env_->GetMapCost(coarse.x, coarse.y))
+        continue;
+      coarse_env_->UpdateCost(coarse.x, coarse.y, cost);
+      coarse_changedcellsV.push_back(coarse);
     }
+    if(!coarse_changedcellsV.empty()){
+      LatticeSCQ scq(coarse_env_, coarse_changedcellsV);
+      coarse_planner_->costs_changed(scq);
+    }
+    if(plan_from_scratch)
+      coarse_planner_->force_planning_from_scratch();
   }
   catch(SBPL_Exception *e){
-    ROS_ERROR("SBPL encountered a fatal exception while setting the goal state");
+    ROS_ERROR("SBPL failed to update the costmap of the coarse lattice");
     return false;
   }
-  
-  int offOnCount = 0;
-  int onOffCount = 0;
-  int allCount = 0;
-  vector<nav2dcell_t> changedcellsV;
+  return true;
+}
 
-  for(unsigned int ix = 0; ix < costmap_ros_->getCostmap()->getSizeInCellsX(); ix++) {
-    for(unsigned int iy = 0; iy < costmap_ros_->getCostmap()->getSizeInCellsY(); iy++) {
+bool SBPLLatticePlanner::planCoarse(const geometry_msgs::PoseStamped& start, const geometry_msgs::PoseStamped& goal,
+                                    geometry_msgs::PoseStamped& fine_goal){
+  fine_goal = goal;
+  coarse_path_.clear();
+  coarse_split_ = 0;
+  if(std::hypot(goal.pose.position.x - start.pose.position.x, goal.pose.position.y - start.pose.position.y)
+     <= fine_planning_distance_)
+    return false;
 
-      unsigned char oldCost = env_->GetMapCost(ix,iy);
-      unsigned char newCost = costMapCostToSBPLCost(costmap_ros_->getCostmap()->getCost(ix,iy));
+  if(!setStartAndGoal(coarse_env_, coarse_planner_, start, goal))
+    return false;
 
-      if(oldCost == newCost) continue;
+  PhaseTimer search_timer;
+  int solution_cost = 0;
+  bool found = false;
+  try{
+    // the fine lattice refines the beginning anyway, the first solution will do
+    coarse_planner_->set_initialsolution_eps(initial_epsilon_);
+    coarse_planner_->set_search_mode(true);
+    found = coarse_planner_->replan(allocated_time_, &coarse_stateIDs_, &solution_cost);
+    if(found)
+      coarse_env_->ConvertStateIDPathintoXYThetaPath(&coarse_stateIDs_, &coarse_path_);
+  }
+  catch(SBPL_Exception *e){
+    ROS_ERROR("SBPL encountered a fatal exception while planning on the coarse lattice");
+    found = false;
+  }
+  search_timer.stop(phase_stats_.coarse_search_wall_time, phase_stats_.coarse_search_cpu_time);
+  phase_stats_.coarse_number_of_expands = coarse_planner_->get_n_expands();
+  if(!found || coarse_path_.empty()){
+    ROS_DEBUG("No coarse plan, planning on the fine lattice only");
+    coarse_path_.clear();
+    return false;
+  }
+  phase_stats_.hierarchical = true;
+  phase_stats_.coarse_solution_cost = solution_cost;
 
-      allCount++;
+  // the fine plan leads to the first coarse pose that is far enough along
+  double distance = 0.0;
+  unsigned int split = 1;
+  for(; split < coarse_path_.size(); ++split){
+    distance += std::hypot(coarse_path_[split].x - coarse_path_[split - 1].x,
+                           coarse_path_[split].y - coarse_path_[split - 1].y);
+    if(distance >= fine_planning_distance_)
+      break;
+  }
+  if(split + 1 >= coarse_path_.size()){
+    coarse_split_ = coarse_path_.size();
+    return true;
+  }
+  coarse_split_ = split + 1;
 
-      //first case - off cell goes on
+  tf2::Quaternion orientation;
+  orientation.setRPY(0, 0, coarse_path_[split].theta);
+  fine_goal.pose.position.x = coarse_path_[split].x + env_origin_x_;
+  fine_goal.pose.position.y = coarse_path_[split].y + env_origin_y_;
+  fine_goal.pose.orientation.x = orientation.getX();
+  fine_goal.pose.orientation.y = orientation.getY();
+  fine_goal.pose.orientation.z = orientation.getZ();
+  fine_goal.pose.orientation.w = orientation.getW();
+  return true;
+}
 
-      if((oldCost != costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE) && oldCost != costMapCostToSBPLCost(costmap_2d::INSCRIBED_INFLATED_OBSTACLE)) &&
-          (newCost == costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE) || newCost == costMapCostToSBPLCost(costmap_2d::INSCRIBED_INFLATED_OBSTACLE))) {
-        offOnCount++;
-      }
+void SBPLLatticePlanner::appendCoarsePlan(std::vector<geometry_msgs::PoseStamped>& plan){
+  if(coarse_split_ >= coarse_path_.size() || plan.empty())
+    return;
+  const unsigned int fine_size = plan.size();
+  plan.resize(fine_size + coarse_path_.size() - coarse_split_);
+  convertPoses(coarse_path_, coarse_split_, coarse_path_.size(), plan[0].pose.position.z, &plan[fine_size]);
+}
+
+void SBPLLatticePlanner::cachePlan(const std::vector<geometry_msgs::PoseStamped>& plan,
+                                   const geometry_msgs::PoseStamped& goal, int solution_cost, unsigned int fine_size,
+                                   bool improved){
+  cached_plan_.clear();
+  if((!reuse_plan_ && !improved) || plan.empty())
+    return;
+
+  // The cells swept by the footprint are tracked in blocks at least as large
+  // as the circumscribed radius: every cell the footprint can reach from a
+  // pose then lies in the block of the pose or one of its neighbours. This
+  // overestimates the swept area a little, but keeps the bookkeeping small
+  // enough for long plans on fine costmaps.
+  const double resolution = costmap_ros_->getCostmap()->getResolution();
+  cached_block_size_ = std::max(1.0, std::ceil(costmap_ros_->getLayeredCostmap()->getCircumscribedRadius() / resolution));
+  int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+  std::vector<int> blocks_x(plan.size()), blocks_y(plan.size());
+  for(unsigned int i = 0; i < plan.size(); ++i){
+    blocks_x[i] = std::floor((plan[i].pose.position.x - env_origin_x_) / resolution / cached_block_size_);
+    blocks_y[i] = std::floor((plan[i].pose.position.y - env_origin_y_) / resolution / cached_block_size_);
+    min_x = std::min(min_x, blocks_x[i] - 1);
+    min_y = std::min(min_y, blocks_y[i] - 1);
+    max_x = std::max(max_x, blocks_x[i] + 1);
+    max_y = std::max(max_y, blocks_y[i] + 1);
+  }
+  // changed cells are never negative
+  min_x = std::max(min_x, 0);
+  min_y = std::max(min_y, 0);
+  if(max_x < min_x || max_y < min_y)
+    return;
+  cached_blocks_x_ = min_x;
+  cached_blocks_y_ = min_y;
+  cached_blocks_width_ = max_x - min_x + 1;
+  cached_blocks_height_ = max_y - min_y + 1;
+  cached_last_pose_.assign(cached_blocks_width_ * cached_blocks_height_, -1);
 
-      if((oldCost == costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE) || oldCost == costMapCostToSBPLCost(costmap_2d::INSCRIBED_INFLATED_OBSTACLE)) &&
-          (newCost != costMapCostToSBPLCost(costmap_2d::LETHAL_OBSTACLE) && newCost != costMapCostToSBPLCost(costmap_2d::INSCRIBED_INFLATED_OBSTACLE))) {
-        onOffCount++;
+  // going backwards, the first pose to reach a block is the last one along
+  // the plan; poses within the same block as the one before add nothing
+  for(int i = plan.size() - 1; i >= 0; --i){
+    if(i + 1 < (int)plan.size() && blocks_x[i] == blocks_x[i + 1] && blocks_y[i] == blocks_y[i + 1])
+      continue;
+    for(int y = std::max(blocks_y[i] - 1, min_y); y <= blocks_y[i] + 1; ++y){
+      for(int x = std::max(blocks_x[i] - 1, min_x); x <= blocks_x[i] + 1; ++x){
+        int& last_pose = cached_last_pose_[(y - min_y) * cached_blocks_width_ + x - min_x];
+        if(last_pose < 0)
+          last_pose = i;
       }
-      env_->UpdateCost(ix, iy, costMapCostToSBPLCost(costmap_ros_->getCostmap()->getCost(ix,iy)));
+    }
+  }
+
+  cached_plan_ = plan;
+  cached_goal_ = goal;
+  cached_solution_cost_ = solution_cost;
+  cached_index_ = 0;
+  cached_fine_size_ = fine_size;
+  cached_origin_x_ = env_origin_x_;
+  cached_origin_y_ = env_origin_y_;
+}
+
+bool SBPLLatticePlanner::reuseCachedPlan(const geometry_msgs::PoseStamped& start,
+                                         const geometry_msgs::PoseStamped& goal,
+                                         const std::vector<nav2dcell_t>& changedcellsV,
+                                         std::vector<geometry_msgs::PoseStamped>& plan){
+  if(cached_plan_.empty())
+    return false;
+
+  // the blocks are in sbpl cells, which must still mean the same
+  if(phase_stats_.reinitialized || phase_stats_.resized ||
+     cached_origin_x_ != env_origin_x_ || cached_origin_y_ != env_origin_y_ ||
+     !(goal.pose.position == cached_goal_.pose.position) ||
+     goal.pose.orientation.z != cached_goal_.pose.orientation.z ||
+     goal.pose.orientation.w != cached_goal_.pose.orientation.w){
+    cached_plan_.clear();
+    return false;
+  }
+
+  // the robot moves along the plan, so look for it from where it was last time
+  unsigned int index = cached_index_;
+  double min_distance = std::numeric_limits<double>::max();
+  for(unsigned int i = cached_index_; i < cached_plan_.size(); ++i){
+    double distance = std::hypot(cached_plan_[i].pose.position.x - start.pose.position.x,
+                                 cached_plan_[i].pose.position.y - start.pose.position.y);
+    if(distance < min_distance){
+      min_distance = distance;
+      index = i;
+    }
+  }
+  const geometry_msgs::Quaternion& q = cached_plan_[index].pose.orientation;
+  double heading_error = std::remainder(2 * atan2(start.pose.orientation.z, start.pose.orientation.w) -
+                                        2 * atan2(q.z, q.w), 2 * M_PI);
+  if(min_distance > reuse_distance_ || std::fabs(heading_error) > M_PI / 4){
+    ROS_DEBUG("The robot is off the last plan, replanning");
+    cached_plan_.clear();
+    return false;
+  }
+
+  // only the fine part of a hierarchical plan is worth following, plan
+  // again before the robot gets too close to the coarse part
+  if(cached_fine_size_ < cached_plan_.size() && 2 * index >= cached_fine_size_){
+    cached_plan_.clear();
+    return false;
+  }
 
-      nav2dcell_t nav2dcell;
-      nav2dcell.x = ix;
-      nav2dcell.y = iy;
-      changedcellsV.push_back(nav2dcell);
+  for(unsigned int i = 0; i < changedcellsV.size(); ++i){
+    unsigned int x = changedcellsV[i].x / cached_block_size_;
+    unsigned int y = changedcellsV[i].y / cached_block_size_;
+    if(x < cached_blocks_x_ || y < cached_blocks_y_ ||
+       x >= cached_blocks_x_ + cached_blocks_width_ || y >= cached_blocks_y_ + cached_blocks_height_)
+      continue;
+    if(cached_last_pose_[(y - cached_blocks_y_) * cached_blocks_width_ + x - cached_blocks_x_] >= (int)index){
+      ROS_DEBUG("The costmap changed on the way of the last plan, replanning");
+      cached_plan_.clear();
+      return false;
     }
   }
 
+  cached_index_ = index;
+  plan.assign(cached_plan_.begin() + index, cached_plan_.end());
+  plan[0].pose = start.pose;
+  // without reuse_plan, an improved solution is only handed over once
+  if(!reuse_plan_)
+    cached_plan_.clear();
+  return true;
+}
+
+bool SBPLLatticePlanner::setStartAndGoal(EnvironmentNAVXYTHETALAT* env, SBPLPlanner* planner,
+                                         const geometry_msgs::PoseStamped& start,
+                                         const geometry_msgs::PoseStamped& goal){
+  double theta_start = 2 * atan2(start.pose.orientation.z, start.pose.orientation.w);
+  double theta_goal = 2 * atan2(goal.pose.orientation.z, goal.pose.orientation.w);
+
   try{
-    if(!changedcellsV.empty()){
-      StateChangeQuery* scq = new LatticeSCQ(env_, changedcellsV);
-      planner_->costs_changed(*scq);
-      delete scq;
+    int ret = env->SetStart(start.pose.position.x - env_origin_x_, start.pose.position.y - env_origin_y_, theta_start);
+    if(ret < 0 || planner->set_start(ret) == 0){
+      ROS_ERROR("ERROR: failed to set start state\n");
+      return false;
     }
+  }
+  catch(SBPL_Exception *e){
+    ROS_ERROR("SBPL encountered a fatal exception while setting the start state");
+    return false;
+  }
 
-    if(allCount > force_scratch_limit_)
-      planner_->force_planning_from_scratch();
+  try{
+    int ret = env->SetGoal(goal.pose.position.x - env_origin_x_, goal.pose.position.y - env_origin_y_, theta_goal);
+    if(ret < 0 || planner->set_goal(ret) == 0){
+      ROS_ERROR("ERROR: failed to set goal state\n");
+      return false;
+    }
   }
   catch(SBPL_Exception *e){
-    ROS_ERROR("SBPL failed to update the costmap");
+    ROS_ERROR("SBPL encountered a fatal exception while setting the goal state");
     return false;
   }
+  return true;
+}
 
-  //setting planner parameters
-  ROS_DEBUG("allocated:%f, init eps:%f\n",allocated_time_,initial_epsilon_);
-  planner_->set_initialsolution_eps(initial_epsilon_);
-  planner_->set_search_mode(false);
+bool SBPLLatticePlanner::syncWorker(PlannerWorker& worker, const std::vector<nav2dcell_t>& changedcellsV,
+                                    bool plan_from_scratch){
+  // syncCostmap has already brought env_ up to date, so the other
+  // environments just copy the new costs of the cells that changed
+  try{
+    for(unsigned int c = 0; c < changedcellsV.size(); ++c)
+      worker.env->UpdateCost(changedcellsV[c].x, changedcellsV[c].y, env_->GetMapCost(changedcellsV[c].x, changedcellsV[c].y));
+    if(!changedcellsV.empty()){
+      LatticeSCQ scq(worker.env, changedcellsV);
+      worker.planner->costs_changed(scq);
+    }
+    if(plan_from_scratch)
+      worker.planner->force_planning_from_scratch();
+  }
+  catch(SBPL_Exception *e){
+    ROS_ERROR("SBPL failed to update the costmap of %s", worker.name.c_str());
+    return false;
+  }
+  return true;
+}
 
-  ROS_DEBUG("[sbpl_lattice_planner] run planner");
-  vector<int> solution_stateIDs;
+bool SBPLLatticePlanner::makePlan(const geometry_msgs::PoseStamped& start,
+                                 const geometry_msgs::PoseStamped& goal,
+                                 std::vector<geometry_msgs::PoseStamped>& plan){
+  if(!initialized_){
+    ROS_ERROR("Global planner is not initialized");
+    return false;
+  }
+
+  // take the planner over from the background search (if any); it checks
+  // for this flag between two time slices and yields the lock
+  preempt_requested_ = true;
+  boost::unique_lock<boost::mutex> lock(planner_mutex_);
+  preempt_requested_ = false;
+  improve_solution_ = false;
+
+  // portfolio searches that lost the race may still be running in env_ and
+  // planner_; they stop at their first solution
+  joinPortfolio();
+  // the planning thread leaves an improvement to us if it could not get the
+  // costmap lock, it has to be converted before the environment changes
+  if(improved_solution_pending_)
+    takeImprovedSolution();
+  phase_stats_ = sbpl_lattice_planner::SBPLLatticePlannerStats();
+  updateEnvironments();
+
+  plan.clear();
+
+  ROS_INFO("[sbpl_lattice_planner] getting start point (%g,%g) goal point (%g,%g)",
+           start.pose.position.x, start.pose.position.y,goal.pose.position.x, goal.pose.position.y);
+
+  // a window that had to grow for this goal is kept until the goal changes
+  if(planning_window_ && !(goal.pose.position == window_goal_.pose.position)){
+    window_scale_ = 1.0;
+    window_goal_ = goal;
+  }
+
+  vector<nav2dcell_t> changedcellsV;
+  bool plan_from_scratch;
   int solution_cost;
-  try{
-    int ret = planner_->replan(allocated_time_, &solution_stateIDs, &solution_cost);
-    if(ret)
+  geometry_msgs::PoseStamped fine_goal;
+  double search_time = allocated_time_;
+  improvement_deadline_ = ros::WallTime::now() + ros::WallDuration(allocated_time_);
+  while(true){
+    if(planning_window_)
+      updateWindow(start, std::vector<geometry_msgs::PoseStamped>(1, goal), window_scale_ * window_margin_);
+    if(!syncCostmap(changedcellsV, plan_from_scratch))
+      return false;
+
+    // nothing to search for if the rest of the last plan is still good
+    if(reuseCachedPlan(start, goal, changedcellsV, plan)){
+      ROS_DEBUG("Reusing the rest of the last plan, %d poses", (int)plan.size());
+      phase_stats_.reused_plan = true;
+      publishPlan(plan);
+      publishStats(phase_stats_, planner_, initial_epsilon_, planner_type_, cached_solution_cost_, plan.size(), start, goal);
+      return true;
+    }
+
+    // in hierarchical mode the fine lattice only plans the first part of the
+    // way and the rest of the coarse plan is appended
+    fine_goal = goal;
+    if(coarse_env_){
+      if(!syncCoarseLattice(changedcellsV, plan_from_scratch))
+        return false;
+      planCoarse(start, goal, fine_goal);
+    }
+    if(!setStartAndGoal(env_, planner_, start, fine_goal)){
+      if(!phase_stats_.hierarchical)
+        return false;
+      ROS_DEBUG("The coarse plan leads to an invalid fine state, planning on the fine lattice only");
+      phase_stats_.hierarchical = false;
+      coarse_split_ = coarse_path_.size();
+      fine_goal = goal;
+      if(!setStartAndGoal(env_, planner_, start, fine_goal))
+        return false;
+    }
+
+    if(!portfolio_.empty())
+      return makePortfolioPlan(start, goal, changedcellsV, plan_from_scratch, plan);
+
+    //setting planner parameters
+    ROS_DEBUG("allocated:%f, init eps:%f\n",search_time,initial_epsilon_);
+    planner_->set_initialsolution_eps(initial_epsilon_);
+    // in async mode we only search until the first solution here and leave
+    // improving it to the planning thread
+    planner_->set_search_mode(async_planning_);
+
+    ROS_DEBUG("[sbpl_lattice_planner] run planner");
+    int ret;
+    try{
+      PhaseTimer search_timer;
+      ret = planner_->replan(search_time, &solution_stateIDs_, &solution_cost);
+      search_timer.stop(phase_stats_.search_wall_time, phase_stats_.search_cpu_time);
+    }
+    catch(SBPL_Exception *e){
+      ROS_ERROR("SBPL encountered a fatal exception while planning");
+      return false;
+    }
+    if(ret){
       ROS_DEBUG("Solution is found\n");
-    else{
+      break;
+    }
+
+    // the window may have cut off the way to the goal, try again in a larger
+    // one for the rest of the allocated time
+    search_time = (improvement_deadline_ - ros::WallTime::now()).toSec();
+    if(!planning_window_ || windowCoversCostmap() || search_time <= 0.0){
       ROS_INFO("Solution not found\n");
-      publishStats(solution_cost, 0, start, goal);
+      publishStats(phase_stats_, planner_, initial_epsilon_, planner_type_, solution_cost, 0, start, goal);
       return false;
     }
+    window_scale_ *= 2.0;
+    ROS_INFO("No solution within the planning window, growing its margin to %f m", window_scale_ * window_margin_);
   }
-  catch(SBPL_Exception *e){
-    ROS_ERROR("SBPL encountered a fatal exception while planning");
+
+  ROS_DEBUG("size of solution=%d", (int)solution_stateIDs_.size());
+
+  if(adaptive_force_scratch_){
+    // a new goal, a new environment or a resized one make sbpl start over
+    // no matter what we asked for
+    bool new_goal = !(fine_goal.pose.position == last_goal_.pose.position) ||
+                    fine_goal.pose.orientation.z != last_goal_.pose.orientation.z ||
+                    fine_goal.pose.orientation.w != last_goal_.pose.orientation.w;
+    updateReplanCostModel(plan_from_scratch || new_goal || phase_stats_.reinitialized || phase_stats_.resized);
+    last_goal_ = fine_goal;
+  }
+
+  PhaseTimer conversion_timer;
+  if(!extractPlan(env_, solution_stateIDs_, sbpl_path_, start, plan))
     return false;
+  appendCoarsePlan(plan);
+  conversion_timer.stop(phase_stats_.path_conversion_wall_time, phase_stats_.path_conversion_cpu_time);
+  rememberSolutionPath();
+  cachePlan(plan, goal, solution_cost, sbpl_path_.size());
+
+  publishPlan(plan);
+  publishStats(phase_stats_, planner_, initial_epsilon_, planner_type_, solution_cost, plan.size(), start, goal);
+
+  if(async_planning_ && planner_->get_solution_eps() > 1.0){
+    // hand the search over to the planning thread to keep lowering epsilon
+    async_start_ = start;
+    async_goal_ = goal;
+    improve_solution_ = true;
+    planner_cond_.notify_one();
   }
 
-  ROS_DEBUG("size of solution=%d", (int)solution_stateIDs.size());
+  return true;
+}
 
-  vector<EnvNAVXYTHETALAT3Dpt_t> sbpl_path;
+bool SBPLLatticePlanner::makePlans(const geometry_msgs::PoseStamped& start,
+                                   const std::vector<geometry_msgs::PoseStamped>& goals,
+                                   double allocated_time, bool first_solution_only,
+                                   std::vector<std::vector<geometry_msgs::PoseStamped> >& plans,
+                                   std::vector<int>& costs, bool stop_at_first_plan){
+  if(!initialized_){
+    ROS_ERROR("Global planner is not initialized");
+    return false;
+  }
+
+  preempt_requested_ = true;
+  boost::unique_lock<boost::mutex> lock(planner_mutex_);
+  preempt_requested_ = false;
+  improve_solution_ = false;
+
+  joinPortfolio();
+  if(improved_solution_pending_)
+    takeImprovedSolution();
+  phase_stats_ = sbpl_lattice_planner::SBPLLatticePlannerStats();
+  updateEnvironments();
+
+  ROS_INFO("[sbpl_lattice_planner] planning from (%g,%g) to %d goals",
+           start.pose.position.x, start.pose.position.y, (int)goals.size());
+
+  // the changes synced here are never checked against the cached plan
+  cached_plan_.clear();
+
+  // one window and one costmap sync for the whole batch
+  if(planning_window_)
+    updateWindow(start, goals, window_margin_);
+  vector<nav2dcell_t> changedcellsV;
+  bool plan_from_scratch;
+  if(!syncCostmap(changedcellsV, plan_from_scratch))
+    return false;
+  // batched queries do not use the coarse lattice, but it must not miss the changes
+  if(coarse_env_ && !syncCoarseLattice(changedcellsV, plan_from_scratch))
+    return false;
+  // the portfolio environments only see the changed cells that are passed on here
+  for(unsigned int i = 1; i < portfolio_.size(); ++i){
+    if(!syncWorker(portfolio_[i], changedcellsV, plan_from_scratch))
+      return false;
+  }
+  // the batch workers are not diffed by makePlan, they get a copy of the whole map
+  if(!batch_workers_.empty()){
+    vector<unsigned char> sbpl_costs;
+    convertCostmap(sbpl_costs);
+    for(unsigned int i = 0; i < batch_workers_.size(); ++i){
+      batch_workers_[i].env->SetMap(sbpl_costs.data());
+      batch_workers_[i].planner->force_planning_from_scratch();
+    }
+  }
+
+  plans.assign(goals.size(), std::vector<geometry_msgs::PoseStamped>());
+  costs.assign(goals.size(), -1);
+  batch_next_goal_ = 0;
+  batch_first_plan_ = goals.size();
+
+  PlannerWorker main_worker;
+  main_worker.name = "main worker";
+  main_worker.initial_epsilon = portfolio_.empty() ? initial_epsilon_ : portfolio_[0].initial_epsilon;
+  main_worker.env = env_;
+  main_worker.planner = planner_;
+
+  boost::thread_group workers;
+  for(unsigned int i = 0; i < batch_workers_.size() && i + 1 < goals.size(); ++i)
+    workers.create_thread(boost::bind(&SBPLLatticePlanner::runBatchWorker, this, &batch_workers_[i],
+                                      boost::cref(start), boost::cref(goals), allocated_time,
+                                      first_solution_only, stop_at_first_plan, &plans, &costs));
+  runBatchWorker(&main_worker, start, goals, allocated_time, first_solution_only, stop_at_first_plan,
+                 &plans, &costs);
+  workers.join_all();
+
+  return true;
+}
+
+void SBPLLatticePlanner::runBatchWorker(PlannerWorker* worker, const geometry_msgs::PoseStamped& start,
+                                        const std::vector<geometry_msgs::PoseStamped>& goals,
+                                        double allocated_time, bool first_solution_only, bool stop_at_first_plan,
+                                        std::vector<std::vector<geometry_msgs::PoseStamped> >* plans,
+                                        std::vector<int>* costs){
+  // Every goal is a new search root, but the start stays the same. With
+  // backward search the heuristic towards the start and the states created
+  // so far in this environment carry over from one goal to the next.
+  // Goals are handed out in list order, so once a goal has a plan, every goal
+  // not handed out yet comes after it. A search that another worker is
+  // already running is not interrupted and takes up to allocated_time.
+  unsigned int index;
+  while((index = batch_next_goal_++) < goals.size()){
+    if(stop_at_first_plan && index > batch_first_plan_)
+      break;
+    if(!setStartAndGoal(worker->env, worker->planner, start, goals[index]))
+      continue;
+
+    int solution_cost;
+    try{
+      worker->planner->set_initialsolution_eps(worker->initial_epsilon);
+      worker->planner->set_search_mode(first_solution_only);
+      if(!worker->planner->replan(allocated_time, &worker->solution_stateIDs, &solution_cost)){
+        ROS_DEBUG("No solution found for goal %u", index);
+        continue;
+      }
+    }
+    catch(SBPL_Exception *e){
+      ROS_ERROR("SBPL encountered a fatal exception while planning to goal %u with the %s", index, worker->name.c_str());
+      continue;
+    }
+
+    if(extractPlan(worker->env, worker->solution_stateIDs, worker->sbpl_path, start, (*plans)[index])){
+      (*costs)[index] = solution_cost;
+      unsigned int first = batch_first_plan_;
+      while(index < first && !batch_first_plan_.compare_exchange_weak(first, index));
+    }
+  }
+}
+
+bool SBPLLatticePlanner::makePlansService(sbpl_lattice_planner::MakePlans::Request& req,
+                                          sbpl_lattice_planner::MakePlans::Response& resp){
+  std::vector<std::vector<geometry_msgs::PoseStamped> > plans;
+  std::vector<int> costs;
+  {
+    // move_base holds the costmap lock while it calls makePlan, do the same here
+    boost::unique_lock<costmap_2d::Costmap2D::mutex_t> lock(*(costmap_ros_->getCostmap()->getMutex()));
+    if(!makePlans(req.start, req.goals, req.allocated_time > 0 ? req.allocated_time : allocated_time_,
+                  req.first_solution_only, plans, costs))
+      return false;
+  }
+
+  resp.success.resize(plans.size());
+  resp.solution_cost.resize(plans.size());
+  resp.plans.resize(plans.size());
+  for(unsigned int i = 0; i < plans.size(); ++i){
+    resp.success[i] = costs[i] >= 0;
+    resp.solution_cost[i] = costs[i];
+    resp.plans[i].header.frame_id = costmap_ros_->getGlobalFrameID();
+    resp.plans[i].header.stamp = ros::Time::now();
+    resp.plans[i].poses.swap(plans[i]);
+  }
+  return true;
+}
+
+bool SBPLLatticePlanner::extractPlan(EnvironmentNAVXYTHETALAT* env, std::vector<int>& solution_stateIDs,
+                                     std::vector<EnvNAVXYTHETALAT3Dpt_t>& sbpl_path,
+                                     const geometry_msgs::PoseStamped& start,
+                                     std::vector<geometry_msgs::PoseStamped>& plan){
   try{
-    env_->ConvertStateIDPathintoXYThetaPath(&solution_stateIDs, &sbpl_path);
+    env->ConvertStateIDPathintoXYThetaPath(&solution_stateIDs, &sbpl_path);
   }
   catch(SBPL_Exception *e){
     ROS_ERROR("SBPL encountered a fatal exception while reconstructing the path");
+    plan.clear();
     return false;
   }
   // if the plan has zero points, add a single point to make move_base happy
   if( sbpl_path.size() == 0 ) {
     EnvNAVXYTHETALAT3Dpt_t s(
-        start.pose.position.x - costmap_ros_->getCostmap()->getOriginX(),
-        start.pose.position.y - costmap_ros_->getCostmap()->getOriginY(),
-        theta_start);
+        start.pose.position.x - env_origin_x_,
+        start.pose.position.y - env_origin_y_,
+        2 * atan2(start.pose.orientation.z, start.pose.orientation.w));
     sbpl_path.push_back(s);
   }
 
   ROS_DEBUG("Plan has %d points.\n", (int)sbpl_path.size());
-  ros::Time plan_time = ros::Time::now();
 
-  //create a message for the plan 
-  nav_msgs::Path gui_path;
-  gui_path.poses.resize(sbpl_path.size());
-  gui_path.header.frame_id = costmap_ros_->getGlobalFrameID();
-  gui_path.header.stamp = plan_time;
-  for(unsigned int i=0; i<sbpl_path.size(); i++){
-    geometry_msgs::PoseStamped pose;
+  // sbpl clears and refills the buffers passed in, and the poses already in
+  // plan are overwritten rather than rebuilt, so with buffers that outlive
+  // the call this only allocates when a plan is longer than any before it
+  plan.resize(sbpl_path.size());
+  convertPoses(sbpl_path, 0, sbpl_path.size(), start.pose.position.z, plan.data());
+  return true;
+}
+
+void SBPLLatticePlanner::convertPoses(const std::vector<EnvNAVXYTHETALAT3Dpt_t>& sbpl_path, unsigned int begin,
+                                      unsigned int end, double z, geometry_msgs::PoseStamped* poses) const{
+  ros::Time plan_time = ros::Time::now();
+  const std::string frame_id = costmap_ros_->getGlobalFrameID();
+  for(unsigned int i=begin; i<end; i++){
+    geometry_msgs::PoseStamped& pose = poses[i - begin];
     pose.header.stamp = plan_time;
-    pose.header.frame_id = costmap_ros_->getGlobalFrameID();
+    pose.header.frame_id = frame_id;
 
-    pose.pose.position.x = sbpl_path[i].x + costmap_ros_->getCostmap()->getOriginX();
-    pose.pose.position.y = sbpl_path[i].y + costmap_ros_->getCostmap()->getOriginY();
-    pose.pose.position.z = start.pose.position.z;
+    pose.pose.position.x = sbpl_path[i].x + env_origin_x_;
+    pose.pose.position.y = sbpl_path[i].y + env_origin_y_;
+    pose.pose.position.z = z;
 
     tf2::Quaternion temp;
     temp.setRPY(0,0,sbpl_path[i].theta);
@@ -450,14 +2017,182 @@ bool SBPLLatticePlanner::makePlan(const geometry_msgs::PoseStamped& start,
     pose.pose.orientation.y = temp.getY();
     pose.pose.orientation.z = temp.getZ();
     pose.pose.orientation.w = temp.getW();
+  }
+}
+
+bool SBPLLatticePlanner::makePortfolioPlan(const geometry_msgs::PoseStamped& start,
+                                           const geometry_msgs::PoseStamped& goal,
+                                           const std::vector<nav2dcell_t>& changedcellsV,
+                                           bool plan_from_scratch,
+                                           std::vector<geometry_msgs::PoseStamped>& plan){
+  for(unsigned int i = 1; i < portfolio_.size(); ++i){
+    if(!syncWorker(portfolio_[i], changedcellsV, plan_from_scratch) ||
+       !setStartAndGoal(portfolio_[i].env, portfolio_[i].planner, start, goal))
+      return false;
+  }
 
-    plan.push_back(pose);
+  {
+    boost::mutex::scoped_lock lock(portfolio_mutex_);
+    portfolio_winner_ = -1;
+    portfolio_running_ = portfolio_.size();
+    portfolio_returned_ = false;
+    portfolio_start_ = start;
+    portfolio_goal_ = goal;
+  }
 
-    gui_path.poses[i] = plan[i];
+  ROS_DEBUG("[sbpl_lattice_planner] run %d planner configurations", (int)portfolio_.size());
+  for(unsigned int i = 0; i < portfolio_.size(); ++i){
+    portfolio_[i].phase_stats = phase_stats_;
+    portfolio_[i].thread.reset(new boost::thread(boost::bind(&SBPLLatticePlanner::runPortfolioWorker, this, i)));
   }
-  plan_pub_.publish(gui_path);
-  publishStats(solution_cost, sbpl_path.size(), start, goal);
 
+  // return as soon as any configuration comes up with a solution, the others
+  // keep running and publish their plan if it turns out to be cheaper
+  boost::unique_lock<boost::mutex> lock(portfolio_mutex_);
+  while(portfolio_winner_ < 0 && portfolio_running_ > 0)
+    portfolio_cond_.wait(lock);
+
+  if(portfolio_winner_ < 0){
+    ROS_INFO("Solution not found\n");
+    publishStats(portfolio_[0].phase_stats, planner_, portfolio_[0].initial_epsilon, portfolio_[0].name, 0, 0, start, goal);
+    return false;
+  }
+
+  PlannerWorker& winner = portfolio_[portfolio_winner_];
+  ROS_DEBUG("Solution is found by %s\n", winner.name.c_str());
+  plan = winner.plan;
+  publishPlan(plan);
+  publishStats(winner.phase_stats, winner.planner, winner.initial_epsilon, winner.name, winner.solution_cost, plan.size(),
+               start, goal);
+  portfolio_returned_ = true;
   return true;
 }
+
+void SBPLLatticePlanner::runPortfolioWorker(unsigned int index){
+  PlannerWorker& entry = portfolio_[index];
+
+  // entry.plan is only read by others once this entry became the winner
+  // below, so the plan can be extracted into it without holding the lock
+  int solution_cost = 0;
+  bool found = false;
+  try{
+    // each configuration only searches until its first solution, in slices
+    // like the planning thread does, so that the searches that lost the race
+    // stop within one slice once the next makePlan wants the planners back
+    entry.planner->set_initialsolution_eps(entry.initial_epsilon);
+    entry.planner->set_search_mode(true);
+    PhaseTimer search_timer;
+    ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration(allocated_time_);
+    double time_left;
+    while(!portfolio_stop_ && (time_left = (deadline - ros::WallTime::now()).toSec()) > 0.0){
+      double slice = std::min(portfolio_time_slice_, time_left);
+      std::clock_t slice_start = std::clock();
+      found = entry.planner->replan(slice, &entry.solution_stateIDs, &solution_cost);
+      // a search that gives up before its slice is over has nothing left to
+      // expand; sbpl measures the slice in process cpu time, so do we
+      if(found || std::clock() - slice_start < slice * CLOCKS_PER_SEC)
+        break;
+    }
+    search_timer.stop(entry.phase_stats.search_wall_time, entry.phase_stats.search_cpu_time);
+    if(found){
+      PhaseTimer conversion_timer;
+      found = extractPlan(entry.env, entry.solution_stateIDs, entry.sbpl_path, portfolio_start_, entry.plan);
+      conversion_timer.stop(entry.phase_stats.path_conversion_wall_time, entry.phase_stats.path_conversion_cpu_time);
+    }
+  }
+  catch(SBPL_Exception *e){
+    ROS_ERROR("SBPL encountered a fatal exception while planning with %s", entry.name.c_str());
+  }
+
+  boost::mutex::scoped_lock lock(portfolio_mutex_);
+  portfolio_running_--;
+  if(found && (portfolio_winner_ < 0 || solution_cost < portfolio_[portfolio_winner_].solution_cost)){
+    entry.solution_cost = solution_cost;
+    portfolio_winner_ = index;
+    if(portfolio_returned_){
+      ROS_DEBUG("%s found a cheaper solution (cost %d)", entry.name.c_str(), solution_cost);
+      publishPlan(entry.plan);
+      publishStats(entry.phase_stats, entry.planner, entry.initial_epsilon, entry.name, solution_cost, entry.plan.size(),
+                   portfolio_start_, portfolio_goal_);
+    }
+  }
+  portfolio_cond_.notify_all();
+}
+
+void SBPLLatticePlanner::publishPlan(const std::vector<geometry_msgs::PoseStamped>& plan){
+  // the plan only goes out for visualization, don't copy it for nobody
+  if(plan_pub_.getNumSubscribers() == 0)
+    return;
+
+  //create a message for the plan, published as a shared pointer so that
+  //intra-process subscribers get it without another copy
+  nav_msgs::PathPtr gui_path = boost::make_shared<nav_msgs::Path>();
+  gui_path->header.frame_id = costmap_ros_->getGlobalFrameID();
+  gui_path->header.stamp = plan.empty() ? ros::Time::now() : plan[0].header.stamp;
+  gui_path->poses = plan;
+  plan_pub_.publish(gui_path);
+}
+
+void SBPLLatticePlanner::planningThread(){
+  boost::unique_lock<boost::mutex> lock(planner_mutex_);
+  while(true){
+    // wait for makePlan to hand over a search, and step aside whenever it
+    // wants the planner back
+    while(!shutdown_ && (preempt_requested_ || !improve_solution_))
+      planner_cond_.wait(lock);
+    if(shutdown_)
+      return;
+
+    improveSolution();
+  }
+}
+
+void SBPLLatticePlanner::improveSolution(){
+  double time_left = (improvement_deadline_ - ros::WallTime::now()).toSec();
+  double previous_eps = planner_->get_solution_eps();
+
+  int solution_cost;
+  try{
+    // the planner keeps its search state between calls as long as start,
+    // goal and costs stay the same, so each slice continues where the last
+    // one stopped
+    planner_->set_search_mode(false);
+    if(!planner_->replan(std::min(async_time_slice_, time_left), &solution_stateIDs_, &solution_cost)){
+      improve_solution_ = false;
+      return;
+    }
+  }
+  catch(SBPL_Exception *e){
+    ROS_ERROR("SBPL encountered a fatal exception while improving the plan");
+    improve_solution_ = false;
+    return;
+  }
+
+  if(planner_->get_solution_eps() < previous_eps){
+    ROS_DEBUG("Improved solution to eps %f", planner_->get_solution_eps());
+    improved_solution_pending_ = true;
+    improved_solution_cost_ = solution_cost;
+
+    // makePlan is called with the costmap lock held and then waits for
+    // planner_mutex_, so waiting for the costmap lock here could deadlock
+    boost::unique_lock<costmap_2d::Costmap2D::mutex_t> costmap_lock(*(costmap_ros_->getCostmap()->getMutex()),
+                                                                    boost::try_to_lock);
+    if(costmap_lock.owns_lock())
+      takeImprovedSolution();
+  }
+
+  if(planner_->get_solution_eps() <= 1.0 || ros::WallTime::now() >= improvement_deadline_)
+    improve_solution_ = false;
+}
+void SBPLLatticePlanner::takeImprovedSolution(){
+  improved_solution_pending_ = false;
+  if(!extractPlan(env_, solution_stateIDs_, sbpl_path_, async_start_, async_plan_))
+    return;
+  appendCoarsePlan(async_plan_);
+  rememberSolutionPath();
+  cachePlan(async_plan_, async_goal_, improved_solution_cost_, sbpl_path_.size(), true);
+  publishPlan(async_plan_);
+  publishStats(phase_stats_, planner_, initial_epsilon_, planner_type_, improved_solution_cost_, async_plan_.size(),
+               async_start_, async_goal_);
+}
 };
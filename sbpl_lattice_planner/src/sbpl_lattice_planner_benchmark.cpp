@@ -0,0 +1,389 @@
+/*********************************************************************
+*
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2008, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*
+*********************************************************************/
+
+// Replays a sequence of maps through SBPLLatticePlanner::makePlan without
+// move_base and reports latency percentiles, expansions, time to the first
+// solution and the peak memory use of the process. Maps are read from PGM
+// files (e.g. worlds/willow.pgm) and inflated with the costmap's own
+// inflation layer, so the planner sees the same costs it would at runtime.
+
+#include <sbpl_lattice_planner/sbpl_lattice_planner.h>
+#include <sbpl_lattice_planner/SBPLLatticePlannerStats.h>
+#include <costmap_2d/costmap_2d_ros.h>
+#include <costmap_2d/inflation_layer.h>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2_ros/buffer.h>
+#include <xmlrpcpp/XmlRpcException.h>
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+
+namespace {
+
+class StatsCollector{
+  public:
+    StatsCollector() : received_(false){
+    }
+
+    void statsCB(const sbpl_lattice_planner::SBPLLatticePlannerStats::ConstPtr& stats){
+      last_ = *stats;
+      received_ = true;
+    }
+
+    void reset(){
+      received_ = false;
+    }
+
+    bool received() const{
+      return received_;
+    }
+
+    const sbpl_lattice_planner::SBPLLatticePlannerStats& last() const{
+      return last_;
+    }
+
+  private:
+    sbpl_lattice_planner::SBPLLatticePlannerStats last_;
+    bool received_;
+};
+
+struct MapResults{
+  MapResults() : attempts(0), successes(0){
+  }
+
+  unsigned int attempts;
+  unsigned int successes;
+  std::vector<double> latency;
+  std::vector<double> time_to_first_solution;
+  std::vector<double> initial_expands;
+  std::vector<double> final_expands;
+  std::vector<double> costmap_sync;
+};
+
+void skipWhitespaceAndComments(std::istream& in){
+  while(in.good()){
+    int c = in.peek();
+    if(c == '#'){
+      std::string comment;
+      std::getline(in, comment);
+    }
+    else if(std::isspace(c))
+      in.get();
+    else
+      break;
+  }
+}
+
+// reads a binary (P5) PGM file with 8 bit pixels
+bool loadPGM(const std::string& filename, unsigned int& width, unsigned int& height,
+             std::vector<unsigned char>& pixels){
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  std::string magic;
+  in >> magic;
+  if(!in || magic != "P5"){
+    ROS_ERROR("%s is not a binary PGM file", filename.c_str());
+    return false;
+  }
+
+  unsigned int max_value;
+  skipWhitespaceAndComments(in);
+  in >> width;
+  skipWhitespaceAndComments(in);
+  in >> height;
+  skipWhitespaceAndComments(in);
+  in >> max_value;
+  in.get();
+  if(!in || max_value > 255){
+    ROS_ERROR("Failed to read the header of %s (only 8 bit images are supported)", filename.c_str());
+    return false;
+  }
+
+  pixels.resize(width * height);
+  in.read(reinterpret_cast<char*>(pixels.data()), pixels.size());
+  if(!in){
+    ROS_ERROR("%s is truncated", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Writes the map into the costmap the way map_server and the static layer
+// would, then inflates it with the cost function of the inflation layer.
+void fillCostmap(costmap_2d::Costmap2DROS& costmap_ros, costmap_2d::InflationLayer* inflation_layer,
+                 const std::vector<unsigned char>& pixels, unsigned int width, unsigned int height,
+                 double resolution, double origin_x, double origin_y,
+                 double occupied_thresh, double free_thresh, double inflation_radius){
+  costmap_ros.getLayeredCostmap()->resizeMap(width, height, resolution, origin_x, origin_y);
+  costmap_2d::Costmap2D* costmap = costmap_ros.getCostmap();
+  unsigned char* grid = costmap->getCharMap();
+
+  // image rows start at the top, costmap rows at the bottom
+  for(unsigned int y = 0; y < height; ++y){
+    const unsigned char* row = &pixels[(height - 1 - y) * width];
+    for(unsigned int x = 0; x < width; ++x){
+      double occupancy = (255 - row[x]) / 255.0;
+      if(occupancy > occupied_thresh)
+        grid[y * width + x] = costmap_2d::LETHAL_OBSTACLE;
+      else if(occupancy < free_thresh)
+        grid[y * width + x] = costmap_2d::FREE_SPACE;
+      else
+        grid[y * width + x] = costmap_2d::NO_INFORMATION;
+    }
+  }
+
+  if(!inflation_layer)
+    return;
+
+  const int radius = std::ceil(inflation_radius / resolution);
+  std::vector<unsigned char> kernel((radius + 1) * (radius + 1), 0);
+  for(int dy = 0; dy <= radius; ++dy)
+    for(int dx = 0; dx <= radius; ++dx)
+      if(std::hypot(dx, dy) <= radius)
+        kernel[dy * (radius + 1) + dx] = inflation_layer->computeCost(std::hypot(dx, dy));
+
+  // obstacle cells surrounded by other obstacles don't add anything
+  std::vector<unsigned int> borders;
+  for(unsigned int y = 0; y < height; ++y){
+    for(unsigned int x = 0; x < width; ++x){
+      unsigned int index = y * width + x;
+      if(grid[index] != costmap_2d::LETHAL_OBSTACLE)
+        continue;
+      if((x > 0 && grid[index - 1] != costmap_2d::LETHAL_OBSTACLE) ||
+         (x + 1 < width && grid[index + 1] != costmap_2d::LETHAL_OBSTACLE) ||
+         (y > 0 && grid[index - width] != costmap_2d::LETHAL_OBSTACLE) ||
+         (y + 1 < height && grid[index + width] != costmap_2d::LETHAL_OBSTACLE))
+        borders.push_back(index);
+    }
+  }
+
+  for(unsigned int i = 0; i < borders.size(); ++i){
+    const int ox = borders[i] % width;
+    const int oy = borders[i] / width;
+    for(int y = std::max(0, oy - radius); y <= std::min<int>(height - 1, oy + radius); ++y){
+      for(int x = std::max(0, ox - radius); x <= std::min<int>(width - 1, ox + radius); ++x){
+        unsigned char cost = kernel[std::abs(y - oy) * (radius + 1) + std::abs(x - ox)];
+        unsigned char& old_cost = grid[y * width + x];
+        // same rule as the inflation layer for unknown cells
+        if(old_cost == costmap_2d::NO_INFORMATION){
+          if(cost >= costmap_2d::INSCRIBED_INFLATED_OBSTACLE)
+            old_cost = cost;
+        }
+        else if(cost > old_cost)
+          old_cost = cost;
+      }
+    }
+  }
+}
+
+double xmlRpcToDouble(XmlRpc::XmlRpcValue& value){
+  if(value.getType() == XmlRpc::XmlRpcValue::TypeInt)
+    return static_cast<int>(value);
+  return static_cast<double>(value);
+}
+
+geometry_msgs::PoseStamped makePose(const std::string& frame_id, double x, double y, double theta){
+  geometry_msgs::PoseStamped pose;
+  pose.header.frame_id = frame_id;
+  pose.header.stamp = ros::Time::now();
+  pose.pose.position.x = x;
+  pose.pose.position.y = y;
+  tf2::Quaternion q;
+  q.setRPY(0, 0, theta);
+  pose.pose.orientation.x = q.getX();
+  pose.pose.orientation.y = q.getY();
+  pose.pose.orientation.z = q.getZ();
+  pose.pose.orientation.w = q.getW();
+  return pose;
+}
+
+// nearest rank percentile, 0 for an empty sample
+double percentile(std::vector<double> values, double p){
+  if(values.empty())
+    return 0.0;
+  std::sort(values.begin(), values.end());
+  size_t rank = std::ceil(p / 100.0 * values.size());
+  return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+void report(const std::string& map, const MapResults& results){
+  ROS_INFO("%s: %u of %u plans found", map.c_str(), results.successes, results.attempts);
+  ROS_INFO("  makePlan [ms]: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f",
+           percentile(results.latency, 50), percentile(results.latency, 90),
+           percentile(results.latency, 99), percentile(results.latency, 100));
+  ROS_INFO("  time to first solution [ms]: p50 %.1f, p90 %.1f, max %.1f",
+           percentile(results.time_to_first_solution, 50), percentile(results.time_to_first_solution, 90),
+           percentile(results.time_to_first_solution, 100));
+  ROS_INFO("  expansions to first solution: p50 %.0f, p90 %.0f; total: p50 %.0f, p90 %.0f",
+           percentile(results.initial_expands, 50), percentile(results.initial_expands, 90),
+           percentile(results.final_expands, 50), percentile(results.final_expands, 90));
+  ROS_INFO("  costmap sync [ms]: p50 %.2f, p90 %.2f, max %.2f",
+           percentile(results.costmap_sync, 50), percentile(results.costmap_sync, 90),
+           percentile(results.costmap_sync, 100));
+}
+
+}
+
+int main(int argc, char** argv){
+  ros::init(argc, argv, "sbpl_lattice_planner_benchmark");
+  ros::NodeHandle private_nh("~");
+
+  std::vector<std::string> maps;
+  double resolution, origin_x, origin_y, occupied_thresh, free_thresh;
+  int repetitions;
+  private_nh.getParam("maps", maps);
+  private_nh.param("resolution", resolution, 0.025);
+  private_nh.param("origin_x", origin_x, 0.0);
+  private_nh.param("origin_y", origin_y, 0.0);
+  private_nh.param("occupied_thresh", occupied_thresh, 0.65);
+  private_nh.param("free_thresh", free_thresh, 0.196);
+  private_nh.param("repetitions", repetitions, 1);
+
+  std::string global_frame, robot_base_frame;
+  double inflation_radius;
+  private_nh.param("costmap/global_frame", global_frame, std::string("map"));
+  private_nh.param("costmap/robot_base_frame", robot_base_frame, std::string("base_link"));
+  private_nh.param("costmap/inflation_layer/inflation_radius", inflation_radius, 0.55);
+
+  std::vector<std::pair<geometry_msgs::PoseStamped, geometry_msgs::PoseStamped> > queries;
+  XmlRpc::XmlRpcValue query_list;
+  try{
+    if(private_nh.getParam("queries", query_list) && query_list.getType() == XmlRpc::XmlRpcValue::TypeArray){
+      for(int i = 0; i < query_list.size(); ++i){
+        XmlRpc::XmlRpcValue& query = query_list[i];
+        if(query.getType() != XmlRpc::XmlRpcValue::TypeArray || query.size() != 6){
+          ROS_ERROR("Query %d is not of the form [start_x, start_y, start_theta, goal_x, goal_y, goal_theta]", i);
+          return 1;
+        }
+        queries.push_back(std::make_pair(
+            makePose(global_frame, xmlRpcToDouble(query[0]), xmlRpcToDouble(query[1]), xmlRpcToDouble(query[2])),
+            makePose(global_frame, xmlRpcToDouble(query[3]), xmlRpcToDouble(query[4]), xmlRpcToDouble(query[5]))));
+      }
+    }
+  }
+  catch(XmlRpc::XmlRpcException& e){
+    ROS_ERROR("Failed to parse the queries parameter: %s", e.getMessage().c_str());
+    return 1;
+  }
+
+  if(maps.empty() || queries.empty()){
+    ROS_ERROR("Both the maps and the queries parameters have to be set");
+    return 1;
+  }
+
+  std::vector<std::vector<unsigned char> > images(maps.size());
+  std::vector<unsigned int> widths(maps.size()), heights(maps.size());
+  for(unsigned int i = 0; i < maps.size(); ++i){
+    if(!loadPGM(maps[i], widths[i], heights[i], images[i]))
+      return 1;
+  }
+
+  // the planner never asks for the robot pose, but Costmap2DROS waits for it
+  tf2_ros::Buffer tf(ros::Duration(10));
+  geometry_msgs::TransformStamped robot_pose;
+  robot_pose.header.frame_id = global_frame;
+  robot_pose.header.stamp = ros::Time::now();
+  robot_pose.child_frame_id = robot_base_frame;
+  robot_pose.transform.rotation.w = 1.0;
+  tf.setTransform(robot_pose, "sbpl_lattice_planner_benchmark", true);
+
+  costmap_2d::Costmap2DROS costmap_ros("costmap", tf);
+  costmap_2d::InflationLayer* inflation_layer = NULL;
+  std::vector<boost::shared_ptr<costmap_2d::Layer> >* plugins = costmap_ros.getLayeredCostmap()->getPlugins();
+  for(unsigned int i = 0; i < plugins->size(); ++i){
+    boost::shared_ptr<costmap_2d::InflationLayer> layer = boost::dynamic_pointer_cast<costmap_2d::InflationLayer>((*plugins)[i]);
+    if(layer)
+      inflation_layer = layer.get();
+  }
+  if(!inflation_layer)
+    ROS_WARN("The costmap has no inflation layer, the maps are not inflated");
+
+  fillCostmap(costmap_ros, inflation_layer, images[0], widths[0], heights[0], resolution, origin_x, origin_y,
+              occupied_thresh, free_thresh, inflation_radius);
+
+  sbpl_lattice_planner::SBPLLatticePlanner planner;
+  ros::WallTime init_start = ros::WallTime::now();
+  planner.initialize("SBPLLatticePlanner", &costmap_ros);
+  double init_time = (ros::WallTime::now() - init_start).toSec();
+
+  StatsCollector collector;
+  ros::Subscriber stats_sub = private_nh.subscribe("SBPLLatticePlanner/sbpl_lattice_planner_stats", 10,
+                                                   &StatsCollector::statsCB, &collector);
+
+  std::vector<geometry_msgs::PoseStamped> plan;
+  for(unsigned int m = 0; m < maps.size() && ros::ok(); ++m){
+    if(m > 0)
+      fillCostmap(costmap_ros, inflation_layer, images[m], widths[m], heights[m], resolution, origin_x, origin_y,
+                  occupied_thresh, free_thresh, inflation_radius);
+
+    MapResults results;
+    for(int r = 0; r < repetitions && ros::ok(); ++r){
+      for(unsigned int q = 0; q < queries.size() && ros::ok(); ++q){
+        collector.reset();
+
+        bool found;
+        ros::WallTime start = ros::WallTime::now();
+        {
+          boost::unique_lock<costmap_2d::Costmap2D::mutex_t> lock(*(costmap_ros.getCostmap()->getMutex()));
+          found = planner.makePlan(queries[q].first, queries[q].second, plan);
+        }
+        results.latency.push_back((ros::WallTime::now() - start).toSec() * 1000.0);
+        results.attempts++;
+        if(found)
+          results.successes++;
+
+        ros::spinOnce();
+        if(collector.received()){
+          const sbpl_lattice_planner::SBPLLatticePlannerStats& stats = collector.last();
+          results.time_to_first_solution.push_back(stats.time_to_first_solution * 1000.0);
+          results.initial_expands.push_back(stats.number_of_expands_initial_solution);
+          results.final_expands.push_back(stats.final_number_of_expands);
+          results.costmap_sync.push_back(stats.costmap_sync_wall_time * 1000.0);
+        }
+      }
+    }
+    report(maps[m], results);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  ROS_INFO("Planner initialization took %.3f sec, peak memory use was %ld kB", init_time, usage.ru_maxrss);
+
+  return 0;
+}
@@ -78,10 +78,12 @@ namespace sbpl_recovery
       ros::Subscriber plan_sub_;
       ros::Publisher vel_pub_;
       boost::mutex plan_mutex_;
-      nav_msgs::Path plan_;
+      nav_msgs::Path::ConstPtr plan_;
       double control_frequency_, sq_planning_distance_, controller_patience_;
       int planning_attempts_, attempts_per_run_;
       bool use_local_frame_;
+      bool batch_planning_;
+      double allocated_time_;
   };
 
 };
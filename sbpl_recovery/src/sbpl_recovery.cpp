@@ -65,6 +65,10 @@ namespace sbpl_recovery
     p_nh.param("attempts_per_run", attempts_per_run_, 3);
     p_nh.param("use_local_frame", use_local_frame_, true);
 
+    //plan to all the candidate goals in one call to the sbpl planner, with the same time limit as the planner itself
+    p_nh.param("batch_planning", batch_planning_, false);
+    p_nh.param("sbpl_lattice_planner/allocated_time", allocated_time_, 10.0);
+
     double planning_distance;
     p_nh.param("planning_distance", planning_distance, 2.0);
     sq_planning_distance_ = planning_distance * planning_distance;
@@ -92,32 +96,9 @@ namespace sbpl_recovery
 
   void SBPLRecovery::planCB(const nav_msgs::Path::ConstPtr& plan)
   {
-    //just copy the plan data over
-
-    geometry_msgs::PoseStamped global_pose;
-    local_costmap_->getRobotPose(global_pose);
-
-    costmap_2d::Costmap2D costmap;
-    costmap = *(local_costmap_->getCostmap());
-
-    if(use_local_frame_)
-    {
-      std::vector<geometry_msgs::PoseStamped> transformed_plan;
-      if(base_local_planner::transformGlobalPlan(*tf_, plan->poses, global_pose, costmap, local_costmap_->getGlobalFrameID(), transformed_plan))
-      {
-        boost::mutex::scoped_lock l(plan_mutex_);
-        if(!transformed_plan.empty())
-          plan_.header = transformed_plan[0].header;
-        plan_.poses = transformed_plan;
-      }
-      else
-        ROS_WARN("Could not transform to frame of the local recovery");
-    }
-    else
-    {
-      boost::mutex::scoped_lock l(plan_mutex_);
-      plan_ = *plan;
-    }
+    //just keep the plan around, it's only transformed when the recovery behavior runs
+    boost::mutex::scoped_lock l(plan_mutex_);
+    plan_ = plan;
   }
 
   double SBPLRecovery::sqDistance(const geometry_msgs::PoseStamped& p1, 
@@ -129,10 +110,19 @@ namespace sbpl_recovery
 
   std::vector<geometry_msgs::PoseStamped> SBPLRecovery::makePlan()
   {
-    boost::mutex::scoped_lock l(plan_mutex_);
     std::vector<geometry_msgs::PoseStamped> sbpl_plan;
 
+    //hold on to the latest plan, so that planCB can take a new one while we're planning
+    nav_msgs::Path::ConstPtr latest_plan;
+    {
+      boost::mutex::scoped_lock l(plan_mutex_);
+      latest_plan = plan_;
+    }
+    if(!latest_plan)
+      return sbpl_plan;
+
     geometry_msgs::PoseStamped start;
+    std::vector<geometry_msgs::PoseStamped> transformed_plan;
     if(use_local_frame_)
     {
       if(!local_costmap_->getRobotPose(start))
@@ -140,6 +130,16 @@ namespace sbpl_recovery
         ROS_ERROR("SBPL recovery behavior could not get the current pose of the robot. Doing nothing.");
         return sbpl_plan;
       }
+
+      {
+        boost::unique_lock<costmap_2d::Costmap2D::mutex_t> lock(*(local_costmap_->getCostmap()->getMutex()));
+        if(!base_local_planner::transformGlobalPlan(*tf_, latest_plan->poses, start, *(local_costmap_->getCostmap()),
+              local_costmap_->getGlobalFrameID(), transformed_plan))
+        {
+          ROS_WARN("Could not transform to frame of the local recovery");
+          return sbpl_plan;
+        }
+      }
     }
     else
     {
@@ -150,45 +150,70 @@ namespace sbpl_recovery
       }
     }
 
+    const std::vector<geometry_msgs::PoseStamped>& plan = use_local_frame_ ? transformed_plan : latest_plan->poses;
+
     //first, we want to walk far enough along the path that we get to a point
     //that is within the recovery distance from the robot. Otherwise, we might
     //move backwards along the plan
     unsigned int index = 0;
-    for(index=0; index < plan_.poses.size(); ++index)
+    for(index=0; index < plan.size(); ++index)
     {
-      if(sqDistance(start, plan_.poses[index]) < sq_planning_distance_)
+      if(sqDistance(start, plan[index]) < sq_planning_distance_)
         break;
     }
 
-    //next, we want to find a goal point that is far enough away from the robot on the
-    //original plan and attempt to plan to it
-    int unsuccessful_attempts = 0;
-    for(unsigned int i = index; i < plan_.poses.size(); ++i)
+    //next, we want to find goal points that are far enough away from the robot on the
+    //original plan, making sure that we don't spend forever planning
+    std::vector<geometry_msgs::PoseStamped> goals;
+    for(unsigned int i = index; i < plan.size() && (int)goals.size() < attempts_per_run_; ++i)
     {
       ROS_DEBUG("SQ Distance: %.2f,  spd: %.2f, start (%.2f, %.2f), goal (%.2f, %.2f)",
-          sqDistance(start, plan_.poses[i]),
+          sqDistance(start, plan[i]),
           sq_planning_distance_,
           start.pose.position.x, start.pose.position.y,
-          plan_.poses[i].pose.position.x,
-          plan_.poses[i].pose.position.y);
-      if(sqDistance(start, plan_.poses[i]) >= sq_planning_distance_ || i == (plan_.poses.size() - 1))
+          plan[i].pose.position.x,
+          plan[i].pose.position.y);
+      if(sqDistance(start, plan[i]) >= sq_planning_distance_ || i == (plan.size() - 1))
+        goals.push_back(plan[i]);
+    }
+
+    if(batch_planning_ && !goals.empty())
+    {
+      //plan to all the goals with one costmap sync, and take the first one that worked... the
+      //goals after it are not planned for, like in the loop below
+      ROS_INFO("Calling sbpl planner with start (%.2f, %.2f) and %u goals",
+          start.pose.position.x, start.pose.position.y, (unsigned int)goals.size());
+      std::vector<std::vector<geometry_msgs::PoseStamped> > plans;
+      std::vector<int> costs;
+      costmap_2d::Costmap2DROS* costmap = use_local_frame_ ? local_costmap_ : global_costmap_;
+      boost::unique_lock<costmap_2d::Costmap2D::mutex_t> lock(*(costmap->getCostmap()->getMutex()));
+      if(global_planner_.makePlans(start, goals, allocated_time_, true, plans, costs, true))
       {
-        ROS_INFO("Calling sbpl planner with start (%.2f, %.2f), goal (%.2f, %.2f)",
-            start.pose.position.x, start.pose.position.y,
-            plan_.poses[i].pose.position.x,
-            plan_.poses[i].pose.position.y);
-        if(global_planner_.makePlan(start, plan_.poses[i], sbpl_plan) && !sbpl_plan.empty())
+        for(unsigned int i = 0; i < plans.size(); ++i)
         {
-          ROS_INFO("Got a valid plan");
-          return sbpl_plan;
+          if(!plans[i].empty())
+          {
+            ROS_INFO("Got a valid plan to goal %u", i);
+            sbpl_plan.swap(plans[i]);
+            return sbpl_plan;
+          }
         }
-        sbpl_plan.clear();
+      }
+      return sbpl_plan;
+    }
 
-        //make sure that we don't spend forever planning
-        unsuccessful_attempts++;
-        if(unsuccessful_attempts >= attempts_per_run_)
-          return sbpl_plan;
+    for(unsigned int i = 0; i < goals.size(); ++i)
+    {
+      ROS_INFO("Calling sbpl planner with start (%.2f, %.2f), goal (%.2f, %.2f)",
+          start.pose.position.x, start.pose.position.y,
+          goals[i].pose.position.x,
+          goals[i].pose.position.y);
+      if(global_planner_.makePlan(start, goals[i], sbpl_plan) && !sbpl_plan.empty())
+      {
+        ROS_INFO("Got a valid plan");
+        return sbpl_plan;
       }
+      sbpl_plan.clear();
     }
 
     return sbpl_plan;
@@ -46,10 +46,35 @@
 #include <geometry_msgs/PoseStamped.h>
 #include <geometry_msgs/Twist.h>
 #include <tf2_ros/buffer.h>
+#include <utility>
+#include <vector>
 
 namespace twist_recovery
 {
 
+/// Outline cells of a footprint for a fixed set of headings, so that footprint costs can be looked
+/// up without transforming and rasterizing the footprint at every pose
+class FootprintKernel
+{
+public:
+
+  /// Rasterize the outline of footprint at num_headings evenly spaced headings
+  void initialize (const std::vector<geometry_msgs::Point>& footprint, double resolution, unsigned num_headings);
+
+  bool initialized () const { return !offsets_.empty(); }
+
+  /// Same as CostmapModel::footprintCost, except that the position is rounded to the center of its cell
+  /// and the heading to the closest precomputed one.  Returns -1 if the footprint leaves the map or touches
+  /// a lethal or unknown cell.
+  double footprintCost (const costmap_2d::Costmap2D& costmap, double x, double y, double theta) const;
+
+private:
+
+  // (row, column) offsets of the outline cells from the cell of the pose, for each heading.
+  // Sorted so that the cells are visited row by row.
+  std::vector<std::vector<std::pair<int, int> > > offsets_;
+};
+
 /// Recovery behavior that takes a given twist and tries to execute it for up to
 /// d seconds, or until reaching an obstacle.  
 class TwistRecovery : public nav_core::RecoveryBehavior
@@ -73,7 +98,19 @@ private:
 
   geometry_msgs::Pose2D getCurrentLocalPose () const;
   geometry_msgs::Twist scaleGivenAccelerationLimits (const geometry_msgs::Twist& twist, const double time_remaining) const;
-  double nonincreasingCostInterval (const geometry_msgs::Pose2D& current, const geometry_msgs::Twist& twist) const;
+  double nonincreasingCostInterval (const geometry_msgs::Pose2D& current, const geometry_msgs::Twist& twist,
+                                    double horizon) const;
+  double nonincreasingCostInterval (const geometry_msgs::Pose2D& current, double current_cost,
+                                    const geometry_msgs::Twist& twist, double horizon, double& final_cost) const;
+  double nonincreasingCostIntervals (const geometry_msgs::Pose2D& current, const std::vector<geometry_msgs::Twist>& twists,
+                                     std::vector<double>& intervals, std::vector<double>& final_costs) const;
+  void checkTwists (const geometry_msgs::Pose2D& current, double current_cost,
+                    const std::vector<geometry_msgs::Twist>& twists, unsigned first, unsigned step,
+                    std::vector<double>* intervals, std::vector<double>* final_costs) const;
+  void createEscapeTwists (int linear_directions, int angular_samples, double linear_speed, double angular_speed);
+  geometry_msgs::Twist chooseEscapeTwist (const geometry_msgs::Pose2D& current, double& interval) const;
+  void runClosedLoop (const geometry_msgs::Twist& twist);
+  void updateFootprint ();
   double normalizedPoseCost (const geometry_msgs::Pose2D& pose) const;
   geometry_msgs::Twist transformTwist (const geometry_msgs::Pose2D& pose) const;
 
@@ -89,6 +126,11 @@ private:
   // Mutable because footprintCost is not declared const
   mutable base_local_planner::CostmapModel* world_model_;
 
+  // Footprint of the robot, fetched once per run of the behavior
+  std::vector<geometry_msgs::Point> footprint_;
+  FootprintKernel footprint_kernel_;
+  int footprint_headings_;
+
   geometry_msgs::Twist base_frame_twist_;
   
   double duration_;
@@ -98,6 +140,16 @@ private:
   double angular_acceleration_limit_;
   double controller_frequency_;
   double simulation_inc_;
+
+  // Optionally recheck the twist against the pose and costmap in every cycle
+  bool closed_loop_;
+  double closed_loop_lookahead_;
+  double closed_loop_max_duration_;
+
+  // Optionally search a fan of twists instead of only applying base_frame_twist_
+  bool escape_search_;
+  int escape_threads_;
+  std::vector<geometry_msgs::Twist> escape_twists_; // base_frame_twist_ comes first
   
   
 };
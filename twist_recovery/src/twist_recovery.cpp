@@ -36,9 +36,14 @@
  */
 
 #include <twist_recovery/twist_recovery.h>
+#include <base_local_planner/line_iterator.h>
+#include <costmap_2d/cost_values.h>
 #include <pluginlib/class_list_macros.hpp>
 #include <tf/transform_datatypes.h>
 #include <tf2/utils.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 // register as a RecoveryBehavior plugin
 PLUGINLIB_EXPORT_CLASS(twist_recovery::TwistRecovery, nav_core::RecoveryBehavior)
@@ -48,10 +53,67 @@ namespace cmap=costmap_2d;
 namespace blp=base_local_planner;
 using std::vector;
 using std::max;
+using std::pair;
 
 namespace twist_recovery
 {
 
+void FootprintKernel::initialize (const vector<gm::Point>& footprint, const double resolution, const unsigned num_headings)
+{
+  offsets_.clear();
+  offsets_.resize(num_headings);
+  vector<int> xs(footprint.size()), ys(footprint.size());
+  for (unsigned i=0; i<num_headings; i++) {
+    // Footprint vertices in cells, relative to the center of the cell of the pose
+    const double theta = 2*M_PI*i/num_headings;
+    const double c = cos(theta), s = sin(theta);
+    for (unsigned j=0; j<footprint.size(); j++) {
+      xs[j] = floor((c*footprint[j].x - s*footprint[j].y)/resolution + 0.5);
+      ys[j] = floor((s*footprint[j].x + c*footprint[j].y)/resolution + 0.5);
+    }
+
+    // Same outline that CostmapModel::footprintCost checks
+    vector<pair<int, int> >& cells = offsets_[i];
+    for (unsigned j=0; j<footprint.size(); j++) {
+      const unsigned k = (j+1) % footprint.size();
+      for (blp::LineIterator line(xs[j], ys[j], xs[k], ys[k]); line.isValid(); line.advance())
+        cells.push_back(pair<int, int>(line.getY(), line.getX()));
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+  }
+}
+
+double FootprintKernel::footprintCost (const cmap::Costmap2D& costmap, const double x, const double y,
+                                       const double theta) const
+{
+  unsigned cx, cy;
+  if (!costmap.worldToMap(x, y, cx, cy))
+    return -1.0;
+
+  const int num_headings = offsets_.size();
+  int heading = static_cast<int>(floor(theta*num_headings/(2*M_PI) + 0.5)) % num_headings;
+  if (heading < 0)
+    heading += num_headings;
+
+  const int size_x = costmap.getSizeInCellsX();
+  const int size_y = costmap.getSizeInCellsY();
+  const unsigned char* map = costmap.getCharMap();
+  unsigned char cost = 0;
+  const vector<pair<int, int> >& cells = offsets_[heading];
+  for (vector<pair<int, int> >::const_iterator it = cells.begin(); it != cells.end(); ++it) {
+    const int my = cy + it->first;
+    const int mx = cx + it->second;
+    if (mx < 0 || my < 0 || mx >= size_x || my >= size_y)
+      return -1.0;
+    const unsigned char c = map[my*size_x + mx];
+    if (c == cmap::LETHAL_OBSTACLE || c == cmap::NO_INFORMATION)
+      return -1.0;
+    cost = max(cost, c);
+  }
+  return cost;
+}
+
 TwistRecovery::TwistRecovery () :
   global_costmap_(NULL), local_costmap_(NULL), tf_(NULL), initialized_(false)
 {}
@@ -92,6 +154,23 @@ void TwistRecovery::initialize (std::string name, tf2_ros::Buffer* tf,
   private_nh.param("angular_acceleration_limit", angular_acceleration_limit_, 3.2);
   private_nh.param("controller_frequency", controller_frequency_, 20.0);
   private_nh.param("simulation_inc", simulation_inc_, 1/controller_frequency_);
+  private_nh.param("footprint_headings", footprint_headings_, 0);
+
+  private_nh.param("closed_loop", closed_loop_, false);
+  private_nh.param("closed_loop_lookahead", closed_loop_lookahead_, duration_);
+  private_nh.param("closed_loop_max_duration", closed_loop_max_duration_, 3*duration_);
+
+  private_nh.param("escape_search", escape_search_, false);
+  private_nh.param("escape_threads", escape_threads_, 1);
+  {
+  int linear_directions, angular_samples;
+  double linear_speed, angular_speed;
+  private_nh.param("escape_linear_directions", linear_directions, 2);
+  private_nh.param("escape_angular_samples", angular_samples, 3);
+  private_nh.param("escape_linear_speed", linear_speed, linear_speed_limit_);
+  private_nh.param("escape_angular_speed", angular_speed, angular_speed_limit_);
+  createEscapeTwists(linear_directions, angular_samples, linear_speed, angular_speed);
+  }
 
   ROS_INFO_STREAM_NAMED ("top", "Initialized twist recovery with twist " <<
                           base_frame_twist_ << " and duration " << duration_);
@@ -108,44 +187,161 @@ gm::Twist scaleTwist (const gm::Twist& twist, const double scale)
   return t;
 }
 
-gm::Pose2D forwardSimulate (const gm::Pose2D& p, const gm::Twist& twist, const double t=1.0)
+// Pose after following twist for time t, starting at p.  By default the twist is applied in the frame of
+// the costmap, as it always has been.  With robot_frame, it is integrated in the base frame as the robot
+// turns, which the escape search needs to tell apart twists with different linear directions.
+gm::Pose2D forwardSimulate (const gm::Pose2D& p, const gm::Twist& twist, const double t=1.0,
+                            const bool robot_frame=false)
 {
   gm::Pose2D p2;
-  p2.x = p.x + twist.linear.x*t;
-  p2.y = p.y + twist.linear.y*t;
-  p2.theta = p.theta + twist.angular.z*t;
+  if (!robot_frame) {
+    p2.x = p.x + twist.linear.x*t;
+    p2.y = p.y + twist.linear.y*t;
+    p2.theta = p.theta + twist.angular.z*t;
+    return p2;
+  }
+
+  // Integrate the rotation of the base frame: a and b are the integrals of cos and sin of the turned angle
+  const double th = twist.angular.z*t;
+  const double a = fabs(th) < 1e-6 ? t : sin(th)/twist.angular.z;
+  const double b = fabs(th) < 1e-6 ? 0.0 : (1-cos(th))/twist.angular.z;
+  const double dx = twist.linear.x*a - twist.linear.y*b;
+  const double dy = twist.linear.x*b + twist.linear.y*a;
+
+  p2.x = p.x + cos(p.theta)*dx - sin(p.theta)*dy;
+  p2.y = p.y + sin(p.theta)*dx + cos(p.theta)*dy;
+  p2.theta = p.theta + th;
   return p2;
 }
 
 /// Return the cost of a pose, modified so that -1 does not equal infinity; instead 1e9 does.
 double TwistRecovery::normalizedPoseCost (const gm::Pose2D& pose) const
 {
-  const double c = world_model_->footprintCost(pose.x, pose.y, pose.theta, local_costmap_->getRobotFootprint(), 0.0, 0.0);
+  const double c = footprint_kernel_.initialized() ?
+    footprint_kernel_.footprintCost(*local_costmap_->getCostmap(), pose.x, pose.y, pose.theta) :
+    world_model_->footprintCost(pose.x, pose.y, pose.theta, footprint_, 0.0, 0.0);
   return c < 0 ? 1e9 : c;
 }
 
 
-/// Return the maximum d <= duration_ such that starting at the current pose, the cost is nonincreasing for
+/// Return the maximum d <= horizon such that starting at the current pose, the cost is nonincreasing for
 /// d seconds if we follow twist
 /// It might also be good to have a threshold such that we're allowed to have lethal cost for at most
 /// the first k of those d seconds, but this is not done
-double TwistRecovery::nonincreasingCostInterval (const gm::Pose2D& current, const gm::Twist& twist) const
+double TwistRecovery::nonincreasingCostInterval (const gm::Pose2D& current, const gm::Twist& twist,
+                                                 const double horizon) const
+{
+  boost::unique_lock<cmap::Costmap2D::mutex_t> lock(*(local_costmap_->getCostmap()->getMutex()));
+  double final_cost;
+  return nonincreasingCostInterval(current, normalizedPoseCost(current), twist, horizon, final_cost);
+}
+
+/// Same as above, with the cost of the current pose already known.  final_cost is set to the cost at the
+/// end of the returned interval.
+double TwistRecovery::nonincreasingCostInterval (const gm::Pose2D& current, const double current_cost,
+                                                 const gm::Twist& twist, const double horizon,
+                                                 double& final_cost) const
 {
-  double cost = normalizedPoseCost(current);
+  double cost = current_cost;
   double t; // Will hold the first time that is invalid
-  for (t=simulation_inc_; t<=duration_; t+=simulation_inc_) {
-    const double next_cost = normalizedPoseCost(forwardSimulate(current, twist, t));
+  for (t=simulation_inc_; t<=horizon; t+=simulation_inc_) {
+    const double next_cost = normalizedPoseCost(forwardSimulate(current, twist, t, escape_search_));
     if (next_cost > cost) {
-      ROS_DEBUG_STREAM_NAMED ("cost", "Cost at " << t << " and pose " << forwardSimulate(current, twist, t)
+      ROS_DEBUG_STREAM_NAMED ("cost", "Cost at " << t << " and pose " << forwardSimulate(current, twist, t, escape_search_)
                               << " is " << next_cost << " which is greater than previous cost " << cost);
       break;
     }
     cost = next_cost;
   }
   
+  final_cost = cost;
   return t-simulation_inc_;
 }
 
+/// nonincreasingCostInterval for each of the twists, all checked against the same costmap by escape_threads_
+/// threads.  Returns the cost of the current pose.
+double TwistRecovery::nonincreasingCostIntervals (const gm::Pose2D& current, const vector<gm::Twist>& twists,
+                                                  vector<double>& intervals, vector<double>& final_costs) const
+{
+  // The threads don't lock the costmap themselves, this lock covers them
+  boost::unique_lock<cmap::Costmap2D::mutex_t> lock(*(local_costmap_->getCostmap()->getMutex()));
+  const double cost = normalizedPoseCost(current);
+  intervals.resize(twists.size());
+  final_costs.resize(twists.size());
+
+  const unsigned num_threads = std::min<unsigned>(max(escape_threads_, 1), twists.size());
+  boost::thread_group threads;
+  for (unsigned i=1; i<num_threads; i++)
+    threads.create_thread(boost::bind(&TwistRecovery::checkTwists, this, boost::cref(current), cost,
+                                      boost::cref(twists), i, num_threads, &intervals, &final_costs));
+  checkTwists(current, cost, twists, 0, num_threads, &intervals, &final_costs);
+  threads.join_all();
+  return cost;
+}
+
+// Check every step-th twist, starting at first
+void TwistRecovery::checkTwists (const gm::Pose2D& current, const double current_cost, const vector<gm::Twist>& twists,
+                                 const unsigned first, const unsigned step,
+                                 vector<double>* intervals, vector<double>* final_costs) const
+{
+  for (unsigned i=first; i<twists.size(); i+=step)
+    (*intervals)[i] = nonincreasingCostInterval(current, current_cost, twists[i], duration_, (*final_costs)[i]);
+}
+
+// Fan of escape twists: every linear direction combined with every angular speed, and the pure rotations
+void TwistRecovery::createEscapeTwists (const int linear_directions, const int angular_samples,
+                                        const double linear_speed, const double angular_speed)
+{
+  escape_twists_.clear();
+  escape_twists_.push_back(base_frame_twist_);
+  for (int i=0; i<angular_samples; i++) {
+    gm::Twist twist;
+    twist.angular.z = angular_samples == 1 ? 0.0 : angular_speed*(2.0*i/(angular_samples-1) - 1);
+    if (twist.angular.z != 0.0)
+      escape_twists_.push_back(twist);
+    for (int j=0; j<linear_directions; j++) {
+      const double dir = 2*M_PI*j/linear_directions;
+      twist.linear.x = linear_speed*cos(dir);
+      twist.linear.y = linear_speed*sin(dir);
+      escape_twists_.push_back(twist);
+    }
+  }
+}
+
+// Pick the escape twist that reduces the cost fastest, preferring longer intervals on ties
+gm::Twist TwistRecovery::chooseEscapeTwist (const gm::Pose2D& current, double& interval) const
+{
+  vector<double> intervals, final_costs;
+  const double cost = nonincreasingCostIntervals(current, escape_twists_, intervals, final_costs);
+
+  unsigned best = 0;
+  double best_rate = intervals[0] > 0 ? (cost-final_costs[0])/intervals[0] : 0.0;
+  for (unsigned i=1; i<escape_twists_.size(); i++) {
+    if (intervals[i] <= 0)
+      continue;
+    const double rate = (cost-final_costs[i])/intervals[i];
+    if (rate > best_rate || (rate == best_rate && intervals[i] > intervals[best])) {
+      best = i;
+      best_rate = rate;
+    }
+  }
+
+  ROS_DEBUG_STREAM_NAMED ("top", "Checked " << escape_twists_.size() << " escape twists, best one reduces the cost from "
+                          << cost << " to " << final_costs[best] << " in " << intervals[best] << " seconds");
+  interval = intervals[best];
+  return escape_twists_[best];
+}
+
+// Fetch the footprint once instead of for every pose that is checked
+void TwistRecovery::updateFootprint ()
+{
+  footprint_ = local_costmap_->getRobotFootprint();
+
+  // CostmapModel checks footprints with less than 3 points differently, so those don't use the kernel
+  const unsigned num_headings = footprint_.size() >= 3 ? max(footprint_headings_, 0) : 0;
+  footprint_kernel_.initialize(footprint_, local_costmap_->getCostmap()->getResolution(), num_headings);
+}
+
 double linearSpeed (const gm::Twist& twist)
 {
   return sqrt(twist.linear.x*twist.linear.x + twist.linear.y*twist.linear.y);
@@ -185,22 +381,56 @@ gm::Pose2D TwistRecovery::getCurrentLocalPose () const
 void TwistRecovery::runBehavior ()
 {
   ROS_ASSERT (initialized_);
+  updateFootprint();
 
-  // Figure out how long we can safely run the behavior
   const gm::Pose2D& current = getCurrentLocalPose();
   
-  const double d = nonincreasingCostInterval(current, base_frame_twist_);
+  // The escape search needs the safe intervals of all candidates to pick one, the closed loop
+  // mode checks the twist as it goes
+  double d;
+  const gm::Twist twist = escape_search_ ? chooseEscapeTwist(current, d) : base_frame_twist_;
+  if (closed_loop_) {
+    runClosedLoop(twist);
+    return;
+  }
+
+  // Figure out how long we can safely run the behavior
+  if (!escape_search_)
+    d = nonincreasingCostInterval(current, twist, duration_);
+
   ros::Rate r(controller_frequency_);
-  ROS_INFO_NAMED ("top", "Applying (%.2f, %.2f, %.2f) for %.2f seconds", base_frame_twist_.linear.x,
-                   base_frame_twist_.linear.y, base_frame_twist_.angular.z, d);
+  ROS_INFO_NAMED ("top", "Applying (%.2f, %.2f, %.2f) for %.2f seconds", twist.linear.x,
+                   twist.linear.y, twist.angular.z, d);
                    
   // We'll now apply this twist open-loop for d seconds (scaled so we can guarantee stopping at the end)
   for (double t=0; t<d; t+=1/controller_frequency_) {
-    pub_.publish(scaleGivenAccelerationLimits(base_frame_twist_, d-t));
+    pub_.publish(scaleGivenAccelerationLimits(twist, d-t));
     r.sleep();
   }    
 }
 
 
-} // namespace twist_recovery
+// Apply twist for as long as the next closed_loop_lookahead_ seconds of it, simulated from the current pose
+// and checked against the latest costmap, keep the cost nonincreasing
+void TwistRecovery::runClosedLoop (const gm::Twist& twist)
+{
+  ROS_INFO_NAMED ("top", "Applying (%.2f, %.2f, %.2f) for up to %.2f seconds", twist.linear.x,
+                   twist.linear.y, twist.angular.z, closed_loop_max_duration_);
+  ros::Rate r(controller_frequency_);
+  const ros::Time start = ros::Time::now();
+  double elapsed = 0.0;
+  while (ros::ok() && elapsed < closed_loop_max_duration_) {
+    const double d = nonincreasingCostInterval(getCurrentLocalPose(), twist,
+                                               std::min(closed_loop_lookahead_, closed_loop_max_duration_-elapsed));
+    if (d <= 0)
+      break;
+    // Scaled so we can stop before the cost would go up
+    pub_.publish(scaleGivenAccelerationLimits(twist, d));
+    r.sleep();
+    elapsed = (ros::Time::now()-start).toSec();
+  }
+  pub_.publish(gm::Twist());
+  ROS_INFO_NAMED ("top", "Stopped twist recovery after %.2f seconds", elapsed);
+}
 
+} // namespace twist_recovery